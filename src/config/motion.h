@@ -36,6 +36,95 @@ https://opensource.org/licenses/MIT. */
 
 // TODO: All linear axes need soft limits.
 
+/*
+    Look-ahead planning
+*/
+
+// How far, in mm, the path is allowed to deviate from the corner between two
+// consecutive moves. Larger values let the machine take corners faster
+// instead of slowing down, smaller values keep the path closer to the actual
+// corner.
+#define JUNCTION_DEVIATION_MM 0.02f
+
+/*
+    Arcs
+*/
+
+// G2/G3 arcs are split into straight segments. This is how far, in mm, the
+// segments are allowed to stray from the actual arc.
+#define ARC_TOLERANCE_MM 0.002f
+// The shortest segment, in mm, that arcs are split into. This keeps tiny
+// arcs from turning into a flood of moves that are only a few steps long.
+#define ARC_MIN_SEGMENT_MM 0.1f
+
+/*
+    Resonance sweep
+*/
+
+// M958 oscillates an axis at each frequency, in Hz, from the start frequency
+// to the end frequency.
+#define RESONANCE_SWEEP_START_HZ 5.0f
+#define RESONANCE_SWEEP_END_HZ 100.0f
+#define RESONANCE_SWEEP_STEP_HZ 5.0f
+// How hard the axis accelerates at each frequency, in mm/s^2 per Hz. Higher
+// frequencies use shorter strokes, so this has to go up with the frequency
+// to keep shaking the axis about as much.
+#define RESONANCE_SWEEP_ACCELERATION_PER_HZ 75.0f
+// How many back and forth cycles to run at each frequency. StallGuard is
+// sampled all through them, apart from the first one.
+#define RESONANCE_SWEEP_CYCLES 10
+
+/*
+    Acceleration tuning
+*/
+
+// M959 moves an axis back and forth over this distance, in mm, at each
+// acceleration, in mm/s^2, from the start acceleration to the end
+// acceleration. The distance needs to be long enough for the axis to reach
+// its velocity.
+#define ACCELERATION_TUNING_DISTANCE_MM 50.0f
+#define ACCELERATION_TUNING_START_MM_S2 1000.0f
+#define ACCELERATION_TUNING_END_MM_S2 20000.0f
+#define ACCELERATION_TUNING_STEP_MM_S2 1000.0f
+// How many times to move back and forth at each acceleration.
+#define ACCELERATION_TUNING_CYCLES 3
+// The fraction of the highest acceleration that didn't stall that M959 W1
+// applies to the axis.
+#define ACCELERATION_TUNING_MARGIN 0.75f
+
+/*
+    StallGuard calibration
+*/
+
+// M960 moves an axis this far, in mm, away from home and back at its homing
+// velocity, sampling the StallGuard load along the way. It needs to be long
+// enough for the axis to reach its homing velocity.
+#define STALLGUARD_CALIBRATION_DISTANCE_MM 50.0f
+// How far the StallGuard result has to drop, as a fraction of the lowest
+// result seen while moving freely, before homing considers the axis stalled.
+// Higher values are more sensitive.
+#define STALLGUARD_CALIBRATION_MARGIN 0.6f
+
+/*
+    Step generation
+*/
+
+// How far ahead, in microseconds, steps are queued up for the PIO. This has
+// to cover any delays in servicing the step alarm, but the queued steps can't
+// be taken back.
+#define STEP_LEAD_US 4000
+// How often, in microseconds, the queued steps are topped up.
+#define STEP_REFILL_US 1000
+// Generate steps on the second core. This leaves the first core to parse
+// G-code, talk to the host, and handle peripherals without ever delaying
+// the steps.
+#define STEP_GENERATION_ON_CORE1 1
+// How late, in microseconds, a step can be before the axis stops trying to
+// catch up with its schedule and carries on from where it is instead.
+// Catching up after a long delay would need a burst of steps that the motor
+// can't follow.
+#define STEP_MAX_CATCH_UP_US 1000
+
 /*
     Configuration for the linear axes (X, Y, and Z).
 */
@@ -51,6 +140,9 @@ https://opensource.org/licenses/MIT. */
 
 #define X_DEFAULT_VELOCITY_MM_S 600.0f
 #define X_DEFAULT_ACCELERATION_MM_S2 2000.0f
+// Maximum jerk, or 0 to use constant acceleration (a trapezoidal profile)
+// instead of a jerk-limited S-curve.
+#define X_DEFAULT_JERK_MM_S3 0.0f
 // Note: steps/mm is dependent on the microsteps, if you change those this
 // will also need to be updated.
 #define X_STEPS_PER_MM 160.0f
@@ -62,6 +154,10 @@ https://opensource.org/licenses/MIT. */
 #define X_HOMING_DISTANCE_MM 500.0f
 #define X_HOMING_BOUNCE_MM 20.0f
 #define X_HOMING_DIR -1
+// Home in a single pass. The exact step that the axis stalls at is latched
+// using the DIAG pin's interrupt, so there's no need for a slower second
+// pass. Set this to 0 to bounce back and seek home a second time.
+#define X_HOMING_SINGLE_PASS 1
 
 #define Y_STEPPER 1
 #define Y_REVERSED 1
@@ -73,9 +169,15 @@ https://opensource.org/licenses/MIT. */
 #define Y2_REVERSED 0
 #define Y2_RUN_CURRENT Y_RUN_CURRENT
 #define Y2_HOLD_CURRENT_MULTIPLIER Y_HOLD_CURRENT_MULTIPLIER
+// Watch both Y motors for stalls while homing and stop each one separately,
+// which squares up the gantry. The offset, in mm, then moves the second motor
+// further away from home if the gantry still isn't quite square.
+#define Y_HOMING_SQUARING 1
+#define Y2_HOMING_OFFSET_MM 0.0f
 
 #define Y_DEFAULT_VELOCITY_MM_S X_DEFAULT_VELOCITY_MM_S
 #define Y_DEFAULT_ACCELERATION_MM_S2 X_DEFAULT_ACCELERATION_MM_S2
+#define Y_DEFAULT_JERK_MM_S3 X_DEFAULT_JERK_MM_S3
 // Note: steps/mm is dependent on the microsteps, if you change those this
 // will also need to be updated.
 #define Y_STEPS_PER_MM 160.0f
@@ -87,6 +189,19 @@ https://opensource.org/licenses/MIT. */
 #define Y_HOMING_DISTANCE_MM 500.0f
 #define Y_HOMING_BOUNCE_MM X_HOMING_BOUNCE_MM
 #define Y_HOMING_DIR -1
+#define Y_HOMING_SINGLE_PASS X_HOMING_SINGLE_PASS
+
+// Input shaping cancels out the gantry's ringing after hard accelerations,
+// which allows for higher accelerations. This can be INPUT_SHAPER_NONE,
+// INPUT_SHAPER_ZV, INPUT_SHAPER_ZVD, or INPUT_SHAPER_MZV. The ringing
+// frequency and damping ratio can be measured with an accelerometer, or
+// tuned with M593.
+#define X_INPUT_SHAPER INPUT_SHAPER_NONE
+#define X_INPUT_SHAPER_FREQUENCY_HZ 40.0f
+#define X_INPUT_SHAPER_DAMPING_RATIO 0.1f
+#define Y_INPUT_SHAPER X_INPUT_SHAPER
+#define Y_INPUT_SHAPER_FREQUENCY_HZ X_INPUT_SHAPER_FREQUENCY_HZ
+#define Y_INPUT_SHAPER_DAMPING_RATIO X_INPUT_SHAPER_DAMPING_RATIO
 #endif
 
 #ifdef JELLYFISH
@@ -102,6 +217,7 @@ https://opensource.org/licenses/MIT. */
 #define Z_HOLD_CURRENT_MULTIPLIER 0.75f
 #define Z_DEFAULT_VELOCITY_MM_S 200.0f
 #define Z_DEFAULT_ACCELERATION_MM_S2 1000.0f
+#define Z_DEFAULT_JERK_MM_S3 0.0f
 #define Z_STEPS_PER_MM 160.0f
 #define Z_HOMING_SENSITIVITY 130
 #define Z_HOMING_VELOCITY_MM_S 200.0f
@@ -109,6 +225,7 @@ https://opensource.org/licenses/MIT. */
 #define Z_HOMING_DISTANCE_MM 100.0f
 #define Z_HOMING_BOUNCE_MM 5.0f
 #define Z_HOMING_DIR -1
+#define Z_HOMING_SINGLE_PASS 1
 #define Z_HOME_ENDSTOP PIN_IN_2
 #endif
 
@@ -123,6 +240,13 @@ https://opensource.org/licenses/MIT. */
 #define A_RUN_CURRENT 0.2f
 #define A_HOLD_CURRENT_MULTIPLIER 0.5f
 #define A_STEPS_PER_DEG 17.778f
+#define A_DEFAULT_VELOCITY_DEG_S 1000.0f
+#define A_DEFAULT_ACCELERATION_DEG_S2 10000.0f
+// 1 to wrap the axis' position around every 360 degrees, so that absolute
+// moves take the shorter way around (350 to 10 degrees turns 20 degrees
+// forwards rather than 340 backwards). The position reported by M114 stays
+// between 0 and 360 degrees.
+#define A_MODULO_ROTATION 0
 
 #define HAS_B_AXIS
 #define B_STEPPER 2
@@ -130,4 +254,7 @@ https://opensource.org/licenses/MIT. */
 #define B_RUN_CURRENT 0.2f
 #define B_HOLD_CURRENT_MULTIPLIER 0.5f
 #define B_STEPS_PER_DEG 17.778f
+#define B_DEFAULT_VELOCITY_DEG_S A_DEFAULT_VELOCITY_DEG_S
+#define B_DEFAULT_ACCELERATION_DEG_S2 A_DEFAULT_ACCELERATION_DEG_S2
+#define B_MODULO_ROTATION A_MODULO_ROTATION
 #endif
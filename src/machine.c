@@ -8,8 +8,11 @@ https://opensource.org/licenses/MIT. */
 #include "config/motion.h"
 #include "config/serial.h"
 #include "hardware/sync.h"
+#include "hardware/timer.h"
 #include "hardware/uart.h"
+#include "pico/multicore.h"
 #include "report.h"
+#include <math.h>
 
 /*
     Macros
@@ -35,17 +38,28 @@ https://opensource.org/licenses/MIT. */
     m->letter.steps_per_mm = LETTER##_STEPS_PER_MM;                                                                    \
     m->letter.velocity_mm_s = LETTER##_DEFAULT_VELOCITY_MM_S;                                                          \
     m->letter.acceleration_mm_s2 = LETTER##_DEFAULT_ACCELERATION_MM_S2;                                                \
+    m->letter.jerk_mm_s3 = LETTER##_DEFAULT_JERK_MM_S3;                                                                \
     m->letter.homing_direction = LETTER##_HOMING_DIR;                                                                  \
     m->letter.homing_distance_mm = LETTER##_HOMING_DISTANCE_MM;                                                        \
     m->letter.homing_bounce_mm = LETTER##_HOMING_BOUNCE_MM;                                                            \
     m->letter.homing_velocity_mm_s = LETTER##_HOMING_VELOCITY_MM_S;                                                    \
     m->letter.homing_acceleration_mm_s2 = LETTER##_HOMING_ACCELERATION_MM_S2;                                          \
-    m->letter.homing_sensitivity = LETTER##_HOMING_SENSITIVITY;
+    m->letter.homing_sensitivity = LETTER##_HOMING_SENSITIVITY;                                                        \
+    m->letter.homing_single_pass = LETTER##_HOMING_SINGLE_PASS;
 
 #define INIT_ROTATIONAL_AXIS(letter, LETTER)                                                                           \
     INIT_STEPPER(LETTER##_STEPPER, LETTER);                                                                            \
     RotationalAxis_init(&(m->letter), #LETTER[0], &(m->stepper[LETTER##_STEPPER]));                                    \
-    m->letter.steps_per_deg = LETTER##_STEPS_PER_DEG;
+    m->letter.steps_per_deg = LETTER##_STEPS_PER_DEG;                                                                  \
+    m->letter.velocity_deg_s = LETTER##_DEFAULT_VELOCITY_DEG_S;                                                        \
+    m->letter.acceleration_deg_s2 = LETTER##_DEFAULT_ACCELERATION_DEG_S2;                                              \
+    m->letter.modulo_rotation = LETTER##_MODULO_ROTATION;
+
+static void sync_planned_position(struct Machine* m);
+static void setup_step_generation(struct Machine* m);
+static void step_generation_core_main();
+
+static struct Machine* step_alarm_machine;
 
 /*
     Public functions
@@ -53,7 +67,23 @@ https://opensource.org/licenses/MIT. */
 
 void Machine_init(struct Machine* m) {
     m->absolute_positioning = true;
-    m->_is_coordinated_move = false;
+    m->_major_axis = NULL;
+    m->_move_queue_head = 0;
+    m->_move_queue_next = 0;
+    m->_move_queue_tail = 0;
+    m->_current_move = NULL;
+    // The first move is planned as following on from the one before it, which
+    // is a standstill.
+    m->_move_queue[MACHINE_MOVE_QUEUE_SIZE - 1] = (struct MachineMove){};
+    m->_plan = (struct MachinePlan){};
+    m->_step_plans[0] = (struct MachinePlan){};
+    m->_step_plans[1] = (struct MachinePlan){};
+    m->_step_plan = 0;
+    m->_stepping = false;
+    m->_streaming = false;
+    m->_stream_finishing = false;
+    m->_stream_starts = 0;
+    m->_abort_requested = false;
 
     TMC2209_init(&m->tmc[0], TMC_UART_INST, 0, tmc_uart_read_write);
     TMC2209_init(&m->tmc[1], TMC_UART_INST, 1, tmc_uart_read_write);
@@ -66,6 +96,25 @@ void Machine_init(struct Machine* m) {
     INIT_STEPPER(Y2_STEPPER, Y2);
 
     LinearAxis_setup_dual(&(m->y), &(m->stepper[Y2_STEPPER]));
+    m->y.homing_squaring = Y_HOMING_SQUARING;
+    m->y.homing_squaring_offset_mm = Y2_HOMING_OFFSET_MM;
+
+    InputShaper_init(&(m->x_shaper), m->x.stepper, NULL);
+    InputShaper_configure(
+        &(m->x_shaper),
+        X_INPUT_SHAPER,
+        X_INPUT_SHAPER_FREQUENCY_HZ,
+        X_INPUT_SHAPER_DAMPING_RATIO,
+        m->x.velocity_mm_s * m->x.steps_per_mm);
+    m->x.shaper = &(m->x_shaper);
+    InputShaper_init(&(m->y_shaper), m->y.stepper, m->y.stepper2);
+    InputShaper_configure(
+        &(m->y_shaper),
+        Y_INPUT_SHAPER,
+        Y_INPUT_SHAPER_FREQUENCY_HZ,
+        Y_INPUT_SHAPER_DAMPING_RATIO,
+        m->y.velocity_mm_s * m->y.steps_per_mm);
+    m->y.shaper = &(m->y_shaper);
 #endif
 
 #ifdef HAS_Z_AXIS
@@ -82,12 +131,25 @@ void Machine_init(struct Machine* m) {
 #ifdef HAS_B_AXIS
     INIT_ROTATIONAL_AXIS(b, B);
 #endif
+
+    sync_planned_position(m);
 }
 
 void Machine_setup(struct Machine* m) {
     Stepper_setup(&(m->stepper[0]));
     Stepper_setup(&(m->stepper[1]));
     Stepper_setup(&(m->stepper[2]));
+
+    step_alarm_machine = m;
+
+#if STEP_GENERATION_ON_CORE1
+    // The step alarm's interrupts are handled by whichever core sets them up,
+    // so that has to happen on core 1. Wait for it to finish.
+    multicore_launch_core1(step_generation_core_main);
+    multicore_fifo_pop_blocking();
+#else
+    setup_step_generation(m);
+#endif
 }
 
 void Machine_enable_steppers(struct Machine* m) {
@@ -134,6 +196,140 @@ void Machine_report_linear_acceleration(struct Machine* m) {
     report_result_ln("T:%0.2f mm/s^2", accel);
 }
 
+void Machine_set_rotational_velocity(struct Machine* m __unused, const struct lilg_Command cmd __unused) {
+#ifdef HAS_A_AXIS
+    if (LILG_FIELD(cmd, A).set) {
+        m->a.velocity_deg_s = lilg_Decimal_to_float(LILG_FIELD(cmd, A));
+    }
+#endif
+#ifdef HAS_B_AXIS
+    if (LILG_FIELD(cmd, B).set) {
+        m->b.velocity_deg_s = lilg_Decimal_to_float(LILG_FIELD(cmd, B));
+    }
+#endif
+}
+
+void Machine_report_rotational_velocity(struct Machine* m __unused) {
+#ifdef HAS_A_AXIS
+    report_result("A:%0.2f ", (double)m->a.velocity_deg_s);
+#endif
+#ifdef HAS_B_AXIS
+    report_result("B:%0.2f ", (double)m->b.velocity_deg_s);
+#endif
+    report_result_ln("deg/s");
+}
+
+void Machine_set_rotational_acceleration(struct Machine* m __unused, const struct lilg_Command cmd __unused) {
+#ifdef HAS_A_AXIS
+    if (LILG_FIELD(cmd, A).set) {
+        m->a.acceleration_deg_s2 = lilg_Decimal_to_float(LILG_FIELD(cmd, A));
+    }
+#endif
+#ifdef HAS_B_AXIS
+    if (LILG_FIELD(cmd, B).set) {
+        m->b.acceleration_deg_s2 = lilg_Decimal_to_float(LILG_FIELD(cmd, B));
+    }
+#endif
+}
+
+void Machine_report_rotational_acceleration(struct Machine* m __unused) {
+#ifdef HAS_A_AXIS
+    report_result("A:%0.2f ", (double)m->a.acceleration_deg_s2);
+#endif
+#ifdef HAS_B_AXIS
+    report_result("B:%0.2f ", (double)m->b.acceleration_deg_s2);
+#endif
+    report_result_ln("deg/s^2");
+}
+
+void Machine_set_linear_jerk(struct Machine* m, const struct lilg_Command cmd) {
+#ifdef HAS_XY_AXES
+    if (cmd.X.set) {
+        m->x.jerk_mm_s3 = lilg_Decimal_to_float(cmd.X);
+    }
+    if (cmd.Y.set) {
+        m->y.jerk_mm_s3 = lilg_Decimal_to_float(cmd.Y);
+    }
+#endif
+#ifdef HAS_Z_AXIS
+    if (cmd.Z.set) {
+        m->z.jerk_mm_s3 = lilg_Decimal_to_float(cmd.Z);
+    }
+#endif
+}
+
+void Machine_report_linear_jerk(struct Machine* m __unused) {
+#ifdef HAS_XY_AXES
+    report_result("X:%0.2f Y:%0.2f ", (double)m->x.jerk_mm_s3, (double)m->y.jerk_mm_s3);
+#endif
+#ifdef HAS_Z_AXIS
+    report_result("Z:%0.2f ", (double)m->z.jerk_mm_s3);
+#endif
+    report_result_ln("");
+}
+
+#ifdef HAS_XY_AXES
+static void set_input_shaper(struct InputShaper* s, struct LinearAxis* axis, const struct lilg_Command cmd) {
+    enum InputShaperType type = s->type;
+    float frequency_hz = s->frequency_hz;
+    float damping_ratio = s->damping_ratio;
+
+    if (LILG_FIELD(cmd, F).set) {
+        frequency_hz = lilg_Decimal_to_float(LILG_FIELD(cmd, F));
+        // Like Marlin, setting a frequency turns shaping on and zero turns
+        // it off.
+        type = frequency_hz > 0.0f ? (type == INPUT_SHAPER_NONE ? INPUT_SHAPER_ZV : type) : INPUT_SHAPER_NONE;
+    }
+    if (LILG_FIELD(cmd, D).set) {
+        damping_ratio = lilg_Decimal_to_float(LILG_FIELD(cmd, D));
+    }
+    if (LILG_FIELD(cmd, T).set) {
+        int32_t t = LILG_FIELD(cmd, T).real;
+        if (t < INPUT_SHAPER_NONE || t > INPUT_SHAPER_MZV) {
+            report_error_ln("unknown input shaper type %li", t);
+            return;
+        }
+        type = (enum InputShaperType)(t);
+    }
+
+    // The shaper has to keep up with the axis at its current velocity.
+    if (!InputShaper_configure(s, type, frequency_hz, damping_ratio, axis->velocity_mm_s * axis->steps_per_mm)) {
+        report_error_ln(
+            "invalid input shaper settings for %c axis at %0.0f mm/s", axis->name, (double)(axis->velocity_mm_s));
+    }
+}
+
+static void report_input_shaper(char name, struct InputShaper* s) {
+    report_result(
+        "%c:%s F:%0.2f D:%0.3f ",
+        name,
+        InputShaper_type_name(s->type),
+        (double)s->frequency_hz,
+        (double)s->damping_ratio);
+}
+#endif
+
+void Machine_set_input_shaping(struct Machine* m __unused, const struct lilg_Command cmd __unused) {
+#ifdef HAS_XY_AXES
+    // X and Y pick which axes to change, both are changed if neither is given.
+    bool both = !cmd.X.set && !cmd.Y.set;
+    if (both || cmd.X.set) {
+        set_input_shaper(&(m->x_shaper), &(m->x), cmd);
+    }
+    if (both || cmd.Y.set) {
+        set_input_shaper(&(m->y_shaper), &(m->y), cmd);
+    }
+#endif
+}
+
+void Machine_report_input_shaping(struct Machine* m __unused) {
+#ifdef HAS_XY_AXES
+    report_input_shaper('X', &(m->x_shaper));
+    report_input_shaper('Y', &(m->y_shaper));
+#endif
+    report_result_ln("");
+}
+
 void Machine_set_motor_current(struct Machine* m, const struct lilg_Command cmd) {
 #ifdef HAS_XY_AXES
     if (cmd.X.set) {
@@ -190,155 +386,1443 @@ void Machine_set_homing_sensitivity(struct Machine* m, const struct lilg_Command
 }
 
 void Machine_home(struct Machine* m, bool x __unused, bool y __unused, bool z __unused) {
+    Machine_wait_for_moves(m);
+
+    // The axes don't depend on each other, so they're all homed at once. The
+    // loop only steps the axes and checks their latches, the drivers are set
+    // up before it and put back after it.
 #ifdef HAS_XY_AXES
     if (x) {
-        LinearAxis_sensorless_home(&(m->x));
+        LinearAxis_start_sensorless_homing(&(m->x));
     }
     if (y) {
-        LinearAxis_sensorless_home(&(m->y));
+        LinearAxis_start_sensorless_homing(&(m->y));
     }
 #endif
 #ifdef HAS_Z_AXIS
     if (z) {
 #ifdef Z_HOME_ENDSTOP
-        LinearAxis_endstop_home(&(m->z));
+        LinearAxis_start_endstop_homing(&(m->z));
 #else
-        LinearAxis_sensorless_home(&(m->z));
+        LinearAxis_start_sensorless_homing(&(m->z));
+#endif
+    }
+#endif
+
+    bool homing = true;
+    while (homing) {
+        homing = false;
+#ifdef HAS_XY_AXES
+        homing |= LinearAxis_homing_step(&(m->x));
+        homing |= LinearAxis_homing_step(&(m->y));
+#endif
+#ifdef HAS_Z_AXIS
+        homing |= LinearAxis_homing_step(&(m->z));
+#endif
+    }
+
+#ifdef HAS_XY_AXES
+    if (x) {
+        LinearAxis_finish_homing(&(m->x));
+    }
+    if (y) {
+        LinearAxis_finish_homing(&(m->y));
+    }
+#endif
+#ifdef HAS_Z_AXIS
+    if (z) {
+        LinearAxis_finish_homing(&(m->z));
+    }
+#endif
+
+    sync_planned_position(m);
+}
+
+// Returns the linear axis that a tuning command is for, or NULL if it doesn't
+// name one.
+static struct LinearAxis* tuned_linear_axis(struct Machine* m __unused, const struct lilg_Command cmd __unused) {
+#ifdef HAS_XY_AXES
+    if (cmd.X.set) {
+        return &(m->x);
+    }
+    if (cmd.Y.set) {
+        return &(m->y);
+    }
 #endif
+#ifdef HAS_Z_AXIS
+    if (cmd.Z.set) {
+        return &(m->z);
     }
 #endif
+    return NULL;
+}
+
+void Machine_tune_acceleration(struct Machine* m, const struct lilg_Command cmd) {
+    struct LinearAxis* axis = tuned_linear_axis(m, cmd);
+    if (axis == NULL) {
+        report_error_ln("acceleration tuning needs an axis");
+        return;
+    }
+
+    float distance_mm = ACCELERATION_TUNING_DISTANCE_MM;
+    float start_mm_s2 = ACCELERATION_TUNING_START_MM_S2;
+    float end_mm_s2 = ACCELERATION_TUNING_END_MM_S2;
+    float step_mm_s2 = ACCELERATION_TUNING_STEP_MM_S2;
+    int32_t cycles = ACCELERATION_TUNING_CYCLES;
+    if (LILG_FIELD(cmd, D).set) {
+        distance_mm = lilg_Decimal_to_float(LILG_FIELD(cmd, D));
+    }
+    if (LILG_FIELD(cmd, S).set) {
+        start_mm_s2 = lilg_Decimal_to_float(LILG_FIELD(cmd, S));
+    }
+    if (LILG_FIELD(cmd, E).set) {
+        end_mm_s2 = lilg_Decimal_to_float(LILG_FIELD(cmd, E));
+    }
+    if (LILG_FIELD(cmd, I).set) {
+        step_mm_s2 = lilg_Decimal_to_float(LILG_FIELD(cmd, I));
+    }
+    if (LILG_FIELD(cmd, C).set) {
+        cycles = LILG_FIELD(cmd, C).real;
+    }
+
+    if (!(distance_mm != 0.0f && start_mm_s2 > 0.0f && end_mm_s2 >= start_mm_s2 && step_mm_s2 > 0.0f && cycles > 0)) {
+        report_error_ln("invalid acceleration tuning settings");
+        return;
+    }
+
+    Machine_wait_for_moves(m);
+    float best_mm_s2 =
+        LinearAxis_tune_acceleration(axis, distance_mm, start_mm_s2, end_mm_s2, step_mm_s2, (uint32_t)(cycles));
+    sync_planned_position(m);
+
+    float tuned_mm_s2 = best_mm_s2 * ACCELERATION_TUNING_MARGIN;
+    if (LILG_FIELD(cmd, W).set && LILG_FIELD(cmd, W).real == 1 && tuned_mm_s2 > 0.0f) {
+        axis->acceleration_mm_s2 = tuned_mm_s2;
+    }
+
+    report_result_ln(
+        "%c:%0.0f tuned:%0.0f current:%0.0f",
+        axis->name,
+        (double)(best_mm_s2),
+        (double)(tuned_mm_s2),
+        (double)(axis->acceleration_mm_s2));
+}
+
+/*
+    Move queue
+
+    G0/G1 moves are planned as soon as they're received and placed into the
+    move queue. Machine_step() executes them in the background, which means
+    the next command can be received and planned while the machine is still
+    moving. All of the axes in a move run at the same time, and the next move
+    starts once they've all finished.
+*/
+
+static inline struct MachineMove* move_queue_at(struct Machine* m, size_t position) {
+    return &(m->_move_queue[position % MACHINE_MOVE_QUEUE_SIZE]);
 }
 
-struct LinearAxisMovement
-__not_in_flash_func(calculate_linear_axis_move)(struct Machine* m, struct LinearAxis* axis, struct lilg_Decimal field) {
+static inline bool move_queue_empty(struct Machine* m) { return m->_move_queue_head == m->_move_queue_tail; }
+
+static inline bool move_queue_full(struct Machine* m) {
+    return m->_move_queue_head - m->_move_queue_tail == MACHINE_MOVE_QUEUE_SIZE - 1;
+}
+
+// Returns true once the step alarm has started all of the queued moves.
+static inline bool __not_in_flash_func(move_queue_started)(struct Machine* m) {
+    return m->_move_queue_next == m->_move_queue_head;
+}
+
+static void sync_planned_position(struct Machine* m) {
+    m->_planned_position.x = m->x.stepper != NULL ? m->x.stepper->total_steps : 0;
+    m->_planned_position.y = m->y.stepper != NULL ? m->y.stepper->total_steps : 0;
+    m->_planned_position.z = m->z.stepper != NULL ? m->z.stepper->total_steps : 0;
+    m->_planned_position.a = m->a.stepper != NULL ? m->a.stepper->total_steps : 0;
+    m->_planned_position.b = m->b.stepper != NULL ? m->b.stepper->total_steps : 0;
+}
+
+// Returns where the G-code field asks the axis to move to, taking relative
+// positioning into account.
+static float linear_axis_destination_mm(
+    struct Machine* m, struct LinearAxis* axis, int32_t planned_steps, struct lilg_Decimal field) {
     float dest_mm = lilg_Decimal_to_float(field);
     if (!m->absolute_positioning) {
-        dest_mm = LinearAxis_get_position_mm(axis) + dest_mm;
+        dest_mm = (float)(planned_steps) * (1.0f / axis->steps_per_mm) + dest_mm;
     }
-    return LinearAxis_calculate_move(axis, dest_mm);
+    return dest_mm;
 }
 
-#ifdef HAS_XY_AXES
-void __not_in_flash_func(bresenham_xy_move)(struct Machine* m, const struct lilg_Command cmd) {
-    struct LinearAxisMovement x_move = calculate_linear_axis_move(m, &(m->x), cmd.X);
-    struct LinearAxisMovement y_move = calculate_linear_axis_move(m, &(m->y), cmd.Y);
-
-    if (x_move.total_step_count > y_move.total_step_count) {
-        m->_major_axis = &(m->x);
-        m->_minor_axis = &(m->y);
-        Bresenham_init(&(m->_bresenham), 0, 0, x_move.total_step_count, y_move.total_step_count);
+static void calculate_linear_axis_move_to(
+    struct LinearAxis* axis, struct LinearAxisMovement* move, int32_t* planned_steps, float dest_mm) {
+    LinearAxis_calculate_move_from(axis, move, *planned_steps, dest_mm);
+    *planned_steps += move->direction * move->total_step_count;
+}
+
+void calculate_linear_axis_move(
+    struct Machine* m,
+    struct LinearAxis* axis,
+    struct LinearAxisMovement* move,
+    int32_t* planned_steps,
+    struct lilg_Decimal field) {
+    float dest_mm = linear_axis_destination_mm(m, axis, *planned_steps, field);
+    calculate_linear_axis_move_to(axis, move, planned_steps, dest_mm);
+}
+
+struct RotationalAxisMovement calculate_rotational_axis_move(
+    struct Machine* m, struct RotationalAxis* axis, int32_t* planned_steps, struct lilg_Decimal field) {
+    float dest_deg = lilg_Decimal_to_float(field);
+    if (m->absolute_positioning) {
+        dest_deg = RotationalAxis_shortest_path_deg(axis, *planned_steps, dest_deg);
     } else {
-        m->_major_axis = &(m->y);
-        m->_minor_axis = &(m->x);
-        Bresenham_init(&(m->_bresenham), 0, 0, y_move.total_step_count, x_move.total_step_count);
+        dest_deg = (float)(*planned_steps) * (1.0f / axis->steps_per_deg) + dest_deg;
     }
 
-    report_info_ln(
-        "coordinated move: major axis: %c, minor axis: %c, major steps: %li, minor steps: %li",
-        m->_major_axis->name,
-        m->_minor_axis->name,
-        m->_bresenham.x1,
-        m->_bresenham.y1);
-
-    LinearAxis_start_move(&(m->x), x_move);
-    LinearAxis_start_move(&(m->y), y_move);
-
-    while (LinearAxis_is_moving(m->_major_axis)) {
-        if (LinearAxis_timed_step(m->_major_axis)) {
-            if (Bresenham_step(&(m->_bresenham))) {
-                LinearAxis_direct_step(m->_minor_axis);
-            }
+    struct RotationalAxisMovement move = RotationalAxis_calculate_move_from(axis, *planned_steps, dest_deg);
+    *planned_steps = RotationalAxis_wrap_steps(axis, *planned_steps + move.direction * move.total_step_count);
+    return move;
+}
+
+static inline absolute_time_t earliest(absolute_time_t a, absolute_time_t b) {
+    return absolute_time_diff_us(a, b) < 0 ? b : a;
+}
+
+static inline absolute_time_t latest(absolute_time_t a, absolute_time_t b) {
+    return absolute_time_diff_us(a, b) > 0 ? b : a;
+}
+
+// Returns when everything that's been queued to the steppers' streams will be
+// finished. Moves that start from a standstill start from here.
+static absolute_time_t __not_in_flash_func(streams_end)(struct Machine* m) {
+    absolute_time_t end = m->_stream_origin;
+    for (size_t i = 0; i < MACHINE_STEPPER_COUNT; i++) { end = latest(end, Stepper_stream_end(&(m->stepper[i]))); }
+    return end;
+}
+
+/*
+    Coordinated linear moves
+
+    The linear axes in a move all travel along a straight line together. The
+    axis that moves the most (the major axis) is timed using its acceleration
+    profile and the other axes (the minor axes) step along with it as
+    directed by a DDA.
+*/
+
+// Returns the linear axis that moves the most in the given move, along with
+// its movement.
+static struct LinearAxis* major_linear_axis(
+    struct Machine* m, struct MachineMove* move, struct LinearAxisMovement** movement) {
+    struct LinearAxis* axis = &(m->x);
+    *movement = &(move->x);
+    if (move->y.total_step_count > (*movement)->total_step_count) {
+        axis = &(m->y);
+        *movement = &(move->y);
+    }
+    if (move->z.total_step_count > (*movement)->total_step_count) {
+        axis = &(m->z);
+        *movement = &(move->z);
+    }
+    return axis;
+}
+
+static void __not_in_flash_func(start_linear_move)(
+    struct Machine* m, struct MachineMove* move, absolute_time_t start_at) {
+    struct LinearAxis* axes[] = {&(m->x), &(m->y), &(m->z)};
+    struct LinearAxisMovement* movements[] = {&(move->x), &(move->y), &(move->z)};
+
+    struct LinearAxisMovement* major_move;
+    m->_major_axis = major_linear_axis(m, move, &major_move);
+    DDA_init(&(m->_dda), major_move->total_step_count);
+
+    if (move->entry_velocity_mm_s > 0.0f) {
+        // The move continues on from the previous one, but the major axis
+        // might be different. Either way, it needs to pick up from the
+        // timing of the previous move's last step.
+        for (size_t i = 0; i < 3; i++) { start_at = latest(start_at, axes[i]->_next_step_at); }
+    }
+
+    for (size_t i = 0; i < 3; i++) {
+        axes[i]->_next_step_at = start_at;
+        if (movements[i]->total_step_count == 0) {
+            continue;
         }
+        if (axes[i] != m->_major_axis) {
+            m->_minor_axes[DDA_add_minor(&(m->_dda), movements[i]->total_step_count)] = axes[i];
+        }
+        LinearAxis_start_move(axes[i], movements[i], start_at);
     }
+}
 
-    // Make sure to finish the minor axis' movement:
-    while (LinearAxis_is_moving(m->_minor_axis)) { LinearAxis_direct_step(m->_minor_axis); }
+static bool __not_in_flash_func(linear_axes_moving)(struct Machine* m) {
+    if (m->_major_axis == NULL) {
+        return false;
+    }
+    if (LinearAxis_is_moving(m->_major_axis)) {
+        return true;
+    }
+    for (size_t i = 0; i < m->_dda.minor_count; i++) {
+        if (LinearAxis_is_moving(m->_minor_axes[i])) {
+            return true;
+        }
+    }
+    return false;
 }
-#endif
 
-void Machine_move(struct Machine* m, const struct lilg_Command cmd) {
+static void __not_in_flash_func(step_linear_axes)(struct Machine* m) {
+    if (m->_major_axis == NULL) {
+        return;
+    }
 
-#ifdef HAS_XY_AXES
-    if (cmd.X.set && cmd.Y.set) {
-        bresenham_xy_move(m, cmd);
-    } else {
-        if (cmd.X.set) {
-            struct LinearAxisMovement move = calculate_linear_axis_move(m, &(m->x), cmd.X);
-            LinearAxis_start_move(&(m->x), move);
-            LinearAxis_wait_for_move(&(m->x));
+    if (LinearAxis_is_moving(m->_major_axis)) {
+        absolute_time_t step_at = m->_major_axis->_next_step_at;
+        if (LinearAxis_queue_step(m->_major_axis, m->_step_horizon)) {
+            uint32_t minor_steps = DDA_step(&(m->_dda));
+            for (size_t i = 0; i < m->_dda.minor_count; i++) {
+                if (minor_steps & (1u << i)) {
+                    LinearAxis_queue_direct_step(m->_minor_axes[i], step_at);
+                }
+            }
         }
-        if (cmd.Y.set) {
-            struct LinearAxisMovement move = calculate_linear_axis_move(m, &(m->y), cmd.Y);
-            LinearAxis_start_move(&(m->y), move);
-            LinearAxis_wait_for_move(&(m->y));
+    } else {
+        // Make sure to finish the minor axes' movement:
+        for (size_t i = 0; i < m->_dda.minor_count; i++) {
+            LinearAxis_queue_direct_step(m->_minor_axes[i], m->_major_axis->_next_step_at);
         }
     }
-#endif
+}
 
-    // TODO: Maybe run all of these basic axes concurrently / round robin?
+// Starts every axis in the given move, returns false if there was nothing to
+// do for the move.
+static bool __not_in_flash_func(start_move)(struct Machine* m, struct MachineMove* move) {
+    // Axes that start from a standstill all start together, once everything
+    // that's already been queued is finished.
+    absolute_time_t start_at = streams_end(m);
+    bool started = false;
 
-#ifdef HAS_Z_AXIS
-    if (cmd.Z.set) {
-        struct LinearAxisMovement move = calculate_linear_axis_move(m, &(m->z), cmd.Z);
-        LinearAxis_start_move(&(m->z), move);
-        LinearAxis_wait_for_move(&(m->z));
-    }
-#endif
+    m->_major_axis = NULL;
 
+    if (move->x.total_step_count > 0 || move->y.total_step_count > 0 || move->z.total_step_count > 0) {
+        start_linear_move(m, move, start_at);
+        started = true;
+    }
 #ifdef HAS_A_AXIS
-    if (LILG_FIELD(cmd, A).set) {
-        float dest_deg = lilg_Decimal_to_float(LILG_FIELD(cmd, A));
-        if (!m->absolute_positioning) {
-            dest_deg = RotationalAxis_get_position_deg(&(m->a)) + dest_deg;
-        }
-        RotationalAxis_start_move(&(m->a), dest_deg);
-        RotationalAxis_wait_for_move(&(m->a));
+    if (move->a.total_step_count > 0) {
+        RotationalAxis_start_move(&(m->a), &(move->a), start_at);
+        started = true;
     }
 #endif
 #ifdef HAS_B_AXIS
-    if (LILG_FIELD(cmd, B).set) {
-        float dest_deg = lilg_Decimal_to_float(LILG_FIELD(cmd, B));
-        if (!m->absolute_positioning) {
-            dest_deg = RotationalAxis_get_position_deg(&(m->b)) + dest_deg;
-        }
-        RotationalAxis_start_move(&(m->b), dest_deg);
-        RotationalAxis_wait_for_move(&(m->b));
+    if (move->b.total_step_count > 0) {
+        RotationalAxis_start_move(&(m->b), &(move->b), start_at);
+        started = true;
     }
 #endif
+
+    return started;
 }
 
-void Machine_report_position(struct Machine* m) {
-    report_result("position:");
-#ifdef HAS_XY_AXES
-    report_result(
-        " X:%0.3f Y:%0.3f", (double)LinearAxis_get_position_mm(&(m->x)), (double)LinearAxis_get_position_mm(&(m->y)));
-#endif
-#ifdef HAS_Z_AXIS
-    report_result(" Z:%0.3f", (double)LinearAxis_get_position_mm(&(m->z)));
-#endif
+// Switches to the planner's latest plan if it was worked out for the moves
+// starting at the given position. The planner might be writing the plan on
+// the other core, in which case the step alarm doesn't wait for it and just
+// keeps going with the plan it already has.
+static void __not_in_flash_func(update_step_plan)(struct Machine* m, size_t position) {
+    uint32_t version = m->_plan.version;
+    __dmb();
+    if (version % 2 != 0 || m->_plan.first_move != position) {
+        return;
+    }
+
+    size_t index = 1 - m->_step_plan;
+    m->_step_plans[index] = m->_plan;
+    __dmb();
+    if (m->_plan.version != version) {
+        return;
+    }
+    m->_step_plan = index;
+}
+
+// Sets up the move's profile from the step alarm's plan. Moves that are past
+// the end of the plan start and end at a standstill, which always follows on
+// from the last move in a plan.
+static void __not_in_flash_func(apply_step_plan)(struct Machine* m, struct MachineMove* move, size_t position) {
+    const struct MachinePlan* plan = &(m->_step_plans[m->_step_plan]);
+    struct MachinePlannedMove planned = {};
+    if (position - plan->first_move < plan->move_count) {
+        planned = plan->moves[position % MACHINE_MOVE_QUEUE_SIZE];
+    }
+
+    move->entry_velocity_mm_s = planned.entry_velocity_mm_s;
+    move->exit_velocity_mm_s = planned.exit_velocity_mm_s;
+    if (move->drive_axis != NULL) {
+        LinearAxisMovement_set_profile(move->drive_move, planned.entry_step_offset, planned.exit_step_offset);
+    }
+}
+
+// Moves on to the next move in the queue once the current one is finished.
+// Returns false once there's nothing left to do.
+static bool __not_in_flash_func(start_next_move)(struct Machine* m) {
+    while (true) {
+        // The current move is finished, so release its spot in the queue.
+        if (m->_current_move != NULL) {
+            m->_current_move = NULL;
+            m->_move_queue_tail++;
+        }
+
+        if (move_queue_started(m)) {
+            return false;
+        }
+
+        size_t position = m->_move_queue_next;
+        struct MachineMove* move = move_queue_at(m, position);
+        update_step_plan(m, position);
+        apply_step_plan(m, move, position);
+        m->_current_move = move;
+
+        // Make sure the move's velocities are written before the planner can
+        // see that it's started, see try_plan_look_ahead().
+        __dmb();
+        m->_move_queue_next = position + 1;
+
+        if (start_move(m, move)) {
+            return true;
+        }
+    }
+}
+
+static bool __not_in_flash_func(axes_moving)(struct Machine* m) {
+    if (linear_axes_moving(m)) {
+        return true;
+    }
 #ifdef HAS_A_AXIS
-    report_result(" A:%0.1f", (double)RotationalAxis_get_position_deg(&(m->a)));
+    if (RotationalAxis_is_moving(&(m->a))) {
+        return true;
+    }
 #endif
 #ifdef HAS_B_AXIS
-    report_result(" B:%0.1f", (double)RotationalAxis_get_position_deg(&(m->b)));
+    if (RotationalAxis_is_moving(&(m->b))) {
+        return true;
+    }
 #endif
-    report_result(" count:");
+    return false;
+}
+
+/*
+    Input shaping
+
+    The input shapers hold on to the X and Y axes' steps and queue the shaped
+    steps a little later, up to a period of the gantry's ringing. Shaped
+    steps can only be queued once it's certain that no earlier steps are
+    coming, otherwise the streams would get out of order.
+*/
+
+// Returns how far along the input shapers can queue their shaped steps.
+static absolute_time_t __not_in_flash_func(shaped_until)(struct Machine* m) {
+    // A move that continues on from the current one picks up from the linear
+    // axes' last step, otherwise the next move starts once everything that's
+    // been queued is finished.
+    bool continues = m->_current_move != NULL && m->_current_move->exit_velocity_mm_s > 0.0f;
+    if (m->_major_axis != NULL && (linear_axes_moving(m) || continues)) {
+        return earliest(m->_major_axis->_next_step_at, m->_step_horizon);
+    }
+    return m->_step_horizon;
+}
+
+// Queues the shaped steps, returns true if there are any left to queue.
+static bool __not_in_flash_func(drain_shapers)(struct Machine* m __unused) {
 #ifdef HAS_XY_AXES
-    report_result(" X:%li Y:%li", m->x.stepper->total_steps, m->y.stepper->total_steps);
-#endif
-#ifdef HAS_Z_AXIS
-    report_result(" Z:%li", m->y.stepper->total_steps);
-#endif
-#ifdef HAS_A_AXIS
-    report_result(" A:%li", m->a.stepper->total_steps);
-#endif
-#ifdef HAS_B_AXIS
-    report_result(" B:%li", m->z.stepper->total_steps);
+    absolute_time_t until = shaped_until(m);
+    InputShaper_drain(&(m->x_shaper), until);
+    InputShaper_drain(&(m->y_shaper), until);
+    return InputShaper_is_pending(&(m->x_shaper)) || InputShaper_is_pending(&(m->y_shaper));
+#else
+    return false;
 #endif
-    report_result_ln("");
 }
 
-void Machine_set_position(struct Machine* m, const struct lilg_Command cmd) {
+/*
+    Look-ahead planning
+
+    Instead of having each move start and end at a standstill, consecutive
+    moves are joined at a velocity that's safe for the corner between them.
+    Each time a move is queued, the entry and exit velocities of all the moves
+    that haven't started yet are re-calculated: a reverse pass makes sure that
+    each move can decelerate in time for the next one (and that the last
+    move comes to a stop) and a forward pass makes sure that each move can
+    actually accelerate to the next move's entry velocity.
+*/
+
+// Returns the fastest that the axis can go. An input shaper's history only has
+// room for so many steps, so a shaped axis is kept to the step rate that fits
+// even if a faster feedrate is asked for after the shaper was set up.
+static float linear_axis_max_velocity_mm_s(struct LinearAxis* axis) {
+    if (axis->shaper == NULL || !InputShaper_enabled(axis->shaper)) {
+        return axis->velocity_mm_s;
+    }
+    return MIN(axis->velocity_mm_s, InputShaper_max_step_rate_hz(axis->shaper) / axis->steps_per_mm);
+}
+
+static float linear_movement_mm(struct LinearAxis* axis, struct LinearAxisMovement* move) {
+    if (move->total_step_count == 0) {
+        return 0.0f;
+    }
+    return (float)(move->direction * move->total_step_count) * (1.0f / axis->steps_per_mm);
+}
+
+// Works out the path that the move's linear axes follow together, and scales
+// the major axis' profile so that the tool moves along the path at the
+// commanded velocity and acceleration. If the move needs to take at least
+// some amount of time (because of the other axes in the move) the path is
+// slowed down to match. Returns how long the linear part of the move takes.
+static float plan_linear_path(struct Machine* m, struct MachineMove* move, float min_move_time_s) {
+    move->distance_mm = 0.0f;
+    if (move->x.total_step_count == 0 && move->y.total_step_count == 0 && move->z.total_step_count == 0) {
+        return 0.0f;
+    }
+
+    struct LinearAxis* axes[] = {&(m->x), &(m->y), &(m->z)};
+    struct LinearAxisMovement* movements[] = {&(move->x), &(move->y), &(move->z)};
+
+    // The path moves at the lowest velocity, acceleration, and jerk of the
+    // axes involved. G0/G1's F sets every axis' velocity, so this is the
+    // commanded feedrate. Each axis only covers its share of the path, so
+    // none of them go over their own limits.
+    float delta_mm[3];
+    float velocity_mm_s = INFINITY;
+    float acceleration_mm_s2 = INFINITY;
+    float jerk_mm_s3 = 0.0f;
+    for (size_t i = 0; i < 3; i++) {
+        delta_mm[i] = linear_movement_mm(axes[i], movements[i]);
+        if (movements[i]->total_step_count == 0) {
+            continue;
+        }
+        velocity_mm_s = MIN(velocity_mm_s, linear_axis_max_velocity_mm_s(axes[i]));
+        acceleration_mm_s2 = MIN(acceleration_mm_s2, axes[i]->acceleration_mm_s2);
+        // Axes without a jerk limit don't limit the path's jerk.
+        if (axes[i]->jerk_mm_s3 > 0.0f) {
+            jerk_mm_s3 = jerk_mm_s3 > 0.0f ? MIN(jerk_mm_s3, axes[i]->jerk_mm_s3) : axes[i]->jerk_mm_s3;
+        }
+    }
+    move->distance_mm = sqrtf(delta_mm[0] * delta_mm[0] + delta_mm[1] * delta_mm[1] + delta_mm[2] * delta_mm[2]);
+    for (size_t i = 0; i < 3; i++) { move->unit_vector[i] = delta_mm[i] / move->distance_mm; }
+
+    if (min_move_time_s > 0.0f) {
+        velocity_mm_s = LinearAxis_velocity_for_move_time(
+            move->distance_mm, min_move_time_s, velocity_mm_s, acceleration_mm_s2, jerk_mm_s3);
+    }
+
+    // Only the major axis is timed, so it's the only one that needs a
+    // profile for its share of the path.
+    struct LinearAxisMovement* major_move;
+    struct LinearAxis* major_axis = major_linear_axis(m, move, &major_move);
+    float ratio = fabsf(linear_movement_mm(major_axis, major_move)) / move->distance_mm;
+    LinearAxis_set_move_kinematics(
+        major_axis, major_move, velocity_mm_s * ratio, acceleration_mm_s2 * ratio, jerk_mm_s3 * ratio);
+
+    return LinearAxis_move_time_s(move->distance_mm, velocity_mm_s, acceleration_mm_s2, jerk_mm_s3);
+}
+
+static void prepare_look_ahead(struct Machine* m, struct MachineMove* move) {
+    move->drive_axis = NULL;
+    move->drive_move = NULL;
+    move->max_entry_velocity_mm_s = 0.0f;
+    move->entry_velocity_mm_s = 0.0f;
+    move->exit_velocity_mm_s = 0.0f;
+
+    // Rotational axes are timed independently of the linear axes, so only
+    // moves that just use linear axes can flow into one another.
+    bool moves_rotational = move->a.total_step_count > 0 || move->b.total_step_count > 0;
+    if (moves_rotational || move->distance_mm == 0.0f) {
+        return;
+    }
+
+    // The drive axis is the one that's timed during execution, which is the
+    // major axis.
+    move->drive_axis = major_linear_axis(m, move, &(move->drive_move));
+
+    // The drive axis' profile covers its share of the path, see
+    // plan_linear_path().
+    move->drive_ratio = fabsf(linear_movement_mm(move->drive_axis, move->drive_move)) / move->distance_mm;
+    move->nominal_velocity_mm_s = move->drive_move->profile->velocity_mm_s / move->drive_ratio;
+    move->acceleration_mm_s2 = move->drive_move->profile->acceleration_mm_s2 / move->drive_ratio;
+}
+
+static float calculate_junction_velocity(struct MachineMove* prev, struct MachineMove* next) {
+    if (prev->drive_axis == NULL || next->drive_axis == NULL) {
+        return 0.0f;
+    }
+
+    float max_velocity_mm_s = MIN(prev->nominal_velocity_mm_s, next->nominal_velocity_mm_s);
+
+    // Junction deviation: treat the corner as if it were an arc that
+    // deviates JUNCTION_DEVIATION_MM from the corner and limit the velocity
+    // to what's needed to stay within the acceleration limit around that
+    // arc. This is the same approach used by Grbl & Marlin.
+    float cos_theta = 0.0f;
+    for (size_t i = 0; i < 3; i++) { cos_theta -= prev->unit_vector[i] * next->unit_vector[i]; }
+
+    // Reversing direction, so the axis has to come to a stop.
+    if (cos_theta > 0.999f) {
+        return 0.0f;
+    }
+    // Continuing in a straight line.
+    if (cos_theta < -0.999f) {
+        return max_velocity_mm_s;
+    }
+
+    float sin_theta_d2 = sqrtf(0.5f * (1.0f - cos_theta));
+    float acceleration_mm_s2 = MIN(prev->acceleration_mm_s2, next->acceleration_mm_s2);
+    float junction_velocity_mm_s =
+        sqrtf(acceleration_mm_s2 * JUNCTION_DEVIATION_MM * sin_theta_d2 / (1.0f - sin_theta_d2));
+
+    return MIN(junction_velocity_mm_s, max_velocity_mm_s);
+}
+
+static inline float max_velocity_change(struct MachineMove* move, float velocity_mm_s) {
+    if (move->drive_axis == NULL) {
+        return 0.0f;
+    }
+    // Work along the drive axis' acceleration ramp so that this holds for
+    // both trapezoidal and S-curve profiles.
+    float ratio = move->drive_ratio;
+    float ramp_distance_mm = LinearAxisMovement_ramp_distance_mm(move->drive_move, velocity_mm_s * ratio);
+    return LinearAxisMovement_ramp_velocity_mm_s(move->drive_move, ramp_distance_mm + move->distance_mm * ratio) /
+           ratio;
+}
+
+static bool try_plan_look_ahead(struct Machine* m) {
+    // Moves that have started can't be changed, so the first move that can be
+    // planned is the next one to start and its entry velocity is pinned to
+    // the exit velocity of the move before it. That move's slot is kept out
+    // of the queue's free space, see move_queue_full().
+    size_t first = m->_move_queue_next;
+    __dmb();
+    size_t head = m->_move_queue_head;
+    if (first == head) {
+        return true;
+    }
+
+    float first_entry_velocity_mm_s = move_queue_at(m, first - 1)->exit_velocity_mm_s;
+    float entry_velocities[MACHINE_MOVE_QUEUE_SIZE];
+    struct MachinePlannedMove planned[MACHINE_MOVE_QUEUE_SIZE];
+
+    // Reverse pass: the last move has to come to a stop, and every move before
+    // it must be able to decelerate to the entry velocity of the next.
+    float next_entry_velocity_mm_s = 0.0f;
+    for (size_t i = head - 1;; i--) {
+        struct MachineMove* move = move_queue_at(m, i);
+        size_t slot = i % MACHINE_MOVE_QUEUE_SIZE;
+        entry_velocities[slot] =
+            MIN(move->max_entry_velocity_mm_s, max_velocity_change(move, next_entry_velocity_mm_s));
+        next_entry_velocity_mm_s = entry_velocities[slot];
+
+        if (i == first) {
+            break;
+        }
+    }
+
+    entry_velocities[first % MACHINE_MOVE_QUEUE_SIZE] = first_entry_velocity_mm_s;
+
+    // Forward pass: each move must be able to accelerate to the entry velocity
+    // of the next. The velocities are turned into offsets into each move's
+    // ramp here, so that the step alarm doesn't need any floating point math
+    // to set up a move's profile.
+    for (size_t i = first; i != head; i++) {
+        struct MachineMove* move = move_queue_at(m, i);
+        size_t slot = i % MACHINE_MOVE_QUEUE_SIZE;
+        size_t next = (i + 1) % MACHINE_MOVE_QUEUE_SIZE;
+
+        planned[slot] = (struct MachinePlannedMove){.entry_velocity_mm_s = entry_velocities[slot]};
+        if (i + 1 != head) {
+            planned[slot].exit_velocity_mm_s =
+                MIN(entry_velocities[next], max_velocity_change(move, entry_velocities[slot]));
+            entry_velocities[next] = planned[slot].exit_velocity_mm_s;
+        }
+
+        if (move->drive_axis == NULL) {
+            continue;
+        }
+
+        planned[slot].entry_step_offset = LinearAxis_calculate_ramp_steps(
+            move->drive_axis, move->drive_move, planned[slot].entry_velocity_mm_s * move->drive_ratio);
+        planned[slot].exit_step_offset = LinearAxis_calculate_ramp_steps(
+            move->drive_axis, move->drive_move, planned[slot].exit_velocity_mm_s * move->drive_ratio);
+    }
+
+    // Publish the plan. The step alarm only takes it up when it starts the
+    // plan's first move, see update_step_plan().
+    struct MachinePlan* plan = &(m->_plan);
+    plan->version++;
+    __dmb();
+    plan->first_move = first;
+    plan->move_count = head - first;
+    for (size_t i = first; i != head; i++) {
+        size_t slot = i % MACHINE_MOVE_QUEUE_SIZE;
+        plan->moves[slot] = planned[slot];
+    }
+    __dmb();
+    plan->version++;
+    __dmb();
+
+    // The step alarm could've started the first move while the plan was being
+    // worked out, in which case that move went ahead with the old plan and
+    // planning has to start over from the move after it.
+    return m->_move_queue_next == first;
+}
+
+static void plan_look_ahead(struct Machine* m) {
+    while (!try_plan_look_ahead(m)) {}
+}
+
+/*
+    Step generation
+
+    Steps are queued ahead of time to the steppers' streams, and the PIO takes
+    care of actually stepping at the right time. A hardware alarm interrupt
+    keeps the streams topped up: each time it fires it queues every step up
+    until STEP_LEAD_US from now and then re-arms itself. All of the streams
+    share a single timeline, so steppers that aren't moving are padded with
+    waits to keep them in step with the ones that are.
+
+    Once the queue runs dry the streams are allowed to play out, after which
+    the alarm is left disarmed until the next move is queued.
+
+    With STEP_GENERATION_ON_CORE1, the alarm and DMA interrupts are handled by
+    core 1 while core 0 parses and plans moves. The move queue only has a
+    single producer (Machine_move()) and a single consumer (the step alarm),
+    the lock is only needed where the planner touches moves that the step
+    alarm could be starting.
+*/
+
+static absolute_time_t __not_in_flash_func(next_step_at)(struct Machine* m) {
+    absolute_time_t next = at_the_end_of_time;
+
+    // Any minor axis steps left over happen along with the major axis' last
+    // step.
+    if (linear_axes_moving(m)) {
+        next = m->_major_axis->_next_step_at;
+    }
+#ifdef HAS_A_AXIS
+    if (RotationalAxis_is_moving(&(m->a))) {
+        next = earliest(next, m->a._axis._next_step_at);
+    }
+#endif
+#ifdef HAS_B_AXIS
+    if (RotationalAxis_is_moving(&(m->b))) {
+        next = earliest(next, m->b._axis._next_step_at);
+    }
+#endif
+
+#ifdef HAS_XY_AXES
+    // Shaped steps still need to be queued even once the axes have stopped.
+    next = earliest(next, InputShaper_next_step_at(&(m->x_shaper)));
+    next = earliest(next, InputShaper_next_step_at(&(m->y_shaper)));
+#endif
+
+    // Nothing is moving, so the next move can start right away.
+    if (is_at_the_end_of_time(next)) {
+        return m->_step_horizon;
+    }
+    return next;
+}
+
+// Maps a time on the streams' timeline to the time that the PIO will
+// actually get there.
+static inline absolute_time_t stream_time_to_real_time(struct Machine* m, absolute_time_t t) {
+    return delayed_by_us(m->_stream_started_at, absolute_time_diff_us(m->_stream_origin, t));
+}
+
+static inline absolute_time_t stream_time_now(struct Machine* m) {
+    return delayed_by_us(m->_stream_origin, absolute_time_diff_us(m->_stream_started_at, get_absolute_time()));
+}
+
+static void start_streams(struct Machine* m) {
+    m->_stream_origin = get_absolute_time();
+    m->_stream_started_at = m->_stream_origin;
+    for (size_t i = 0; i < MACHINE_STEPPER_COUNT; i++) { Stepper_prepare_stream(&(m->stepper[i]), m->_stream_origin); }
+    m->_streaming = true;
+    m->_stream_finishing = false;
+}
+
+// If the step alarm was held up for longer than the steps queued ahead, the
+// PIO runs out of steps and waits for more. The steps queued afterwards
+// still happen at the right intervals relative to each other, but the whole
+// stream is now behind real time by however long the PIO waited- so move the
+// stream's start time to match, otherwise the steps would be queued less far
+// ahead than they should be from then on.
+static void __not_in_flash_func(check_for_underrun)(struct Machine* m) {
+    absolute_time_t now = stream_time_now(m);
+    int64_t late_us = absolute_time_diff_us(streams_end(m), now);
+    if (late_us <= 0) {
+        return;
+    }
+
+    for (size_t i = 0; i < MACHINE_STEPPER_COUNT; i++) { m->stepper[i].missed_deadlines++; }
+    m->_stream_started_at = delayed_by_us(m->_stream_started_at, late_us);
+}
+
+static bool __not_in_flash_func(streams_full)(struct Machine* m) {
+    for (size_t i = 0; i < MACHINE_STEPPER_COUNT; i++) {
+        if (Stepper_stream_full(&(m->stepper[i]))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool __not_in_flash_func(streams_drained)(struct Machine* m) {
+    for (size_t i = 0; i < MACHINE_STEPPER_COUNT; i++) {
+        if (!Stepper_stream_drained(&(m->stepper[i]))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void __not_in_flash_func(set_step_alarm)(struct Machine* m, absolute_time_t at) {
+    // hardware_alarm_set_target() returns true if the target time has already
+    // passed, in which case try again shortly.
+    while (hardware_alarm_set_target(m->_step_alarm, at)) { at = make_timeout_time_us(10); }
+}
+
+// Stops all movement and throws away the queue, must be called from the step
+// alarm or once it's stopped.
+static void stop_stepping(struct Machine* m) {
+    LinearAxis_stop(&(m->x));
+    LinearAxis_stop(&(m->y));
+    LinearAxis_stop(&(m->z));
+    RotationalAxis_stop(&(m->a));
+    RotationalAxis_stop(&(m->b));
+#ifdef HAS_XY_AXES
+    InputShaper_reset(&(m->x_shaper));
+    InputShaper_reset(&(m->y_shaper));
+#endif
+
+    m->_major_axis = NULL;
+    m->_current_move = NULL;
+    m->_move_queue_next = m->_move_queue_head;
+    m->_move_queue_tail = m->_move_queue_head;
+    // Whatever's queued next starts from a standstill, see
+    // try_plan_look_ahead().
+    move_queue_at(m, m->_move_queue_head - 1)->exit_velocity_mm_s = 0.0f;
+
+    // Note: steps that were queued but didn't happen are still counted in
+    // the steppers' positions, so the machine needs to be re-homed.
+    for (size_t i = 0; i < MACHINE_STEPPER_COUNT; i++) { Stepper_stop_stream(&(m->stepper[i])); }
+    m->_streaming = false;
+    m->_stream_finishing = false;
+    m->_abort_requested = false;
+    m->_stepping = false;
+}
+
+// Called by the step alarm before it starts the streams, returns false if
+// there's nothing to do and it should stop. A move could be queued in between
+// checking and stopping, so the queue is checked again afterwards, see
+// start_stepping(). If start_stepping() also saw the step alarm stop, the
+// step alarm gets woken up again, which is harmless.
+static bool __not_in_flash_func(keep_stepping)(struct Machine* m) {
+    if (!move_queue_started(m)) {
+        return true;
+    }
+    m->_stepping = false;
+    __dmb();
+    if (move_queue_started(m)) {
+        return false;
+    }
+    m->_stepping = true;
+    return true;
+}
+
+static void __not_in_flash_func(step_alarm_callback)(uint alarm_num) {
+    (void)(alarm_num);
+    struct Machine* m = step_alarm_machine;
+
+    if (m->_abort_requested) {
+        stop_stepping(m);
+        return;
+    }
+
+    if (m->_stream_finishing) {
+        if (!streams_drained(m)) {
+            set_step_alarm(m, make_timeout_time_us(STEP_REFILL_US));
+            return;
+        }
+        m->_streaming = false;
+    }
+
+    bool starting = !m->_streaming;
+    if (starting) {
+        if (!keep_stepping(m)) {
+            return;
+        }
+        start_streams(m);
+    }
+
+    if (!starting) {
+        check_for_underrun(m);
+    }
+
+    m->_step_horizon = delayed_by_us(stream_time_now(m), STEP_LEAD_US);
+
+    bool moving = true;
+    while (!streams_full(m)) {
+        moving = Machine_step(m);
+        if (!moving || absolute_time_diff_us(m->_step_horizon, next_step_at(m)) > 0) {
+            break;
+        }
+    }
+
+    if (moving) {
+        // Pad out the streams up until the next step, so that steppers that
+        // aren't moving don't run dry.
+        absolute_time_t pad_until = earliest(next_step_at(m), m->_step_horizon);
+        for (size_t i = 0; i < MACHINE_STEPPER_COUNT; i++) { Stepper_pad_stream(&(m->stepper[i]), pad_until); }
+    } else {
+        m->_stream_finishing = true;
+    }
+
+    for (size_t i = 0; i < MACHINE_STEPPER_COUNT; i++) { Stepper_flush_stream(&(m->stepper[i])); }
+
+    if (starting) {
+        Stepper_start_streams(m->stepper, MACHINE_STEPPER_COUNT);
+        m->_stream_started_at = get_absolute_time();
+        __dmb();
+        m->_stream_starts++;
+    }
+
+    if (m->_stream_finishing) {
+        set_step_alarm(m, stream_time_to_real_time(m, streams_end(m)));
+    } else {
+        set_step_alarm(m, make_timeout_time_us(STEP_REFILL_US));
+    }
+}
+
+static void setup_step_generation(struct Machine* m) {
+    m->_step_alarm = hardware_alarm_claim_unused(true);
+    hardware_alarm_set_callback(m->_step_alarm, step_alarm_callback);
+    Stepper_setup_stream_irq();
+}
+
+static void step_generation_core_main() {
+    setup_step_generation(step_alarm_machine);
+    multicore_fifo_push_blocking(0);
+
+    // Everything happens in the step alarm and DMA interrupts.
+    while (1) { __wfi(); }
+}
+
+// Wakes up the step alarm if it's stopped. This pairs with keep_stepping():
+// either this sees that the step alarm stopped, or the step alarm sees the
+// newly queued move.
+static void start_stepping(struct Machine* m) {
+    __dmb();
+    if (!m->_stepping) {
+        m->_stepping = true;
+        set_step_alarm(m, make_timeout_time_us(20));
+    }
+}
+
+// Returns the next free slot in the move queue, waiting for the step alarm to
+// make room if the queue is full.
+static struct MachineMove* begin_move(struct Machine* m) {
+    while (move_queue_full(m)) {}
+
+    struct MachineMove* move = move_queue_at(m, m->_move_queue_head);
+    *move = (struct MachineMove){};
+    return move;
+}
+
+// Plans the move written into the slot from begin_move() and adds it to the
+// queue.
+static void queue_move(struct Machine* m, struct MachineMove* move) {
+    // All of the axes in the move start and finish together, so the quicker
+    // axes are slowed down to take as long as the slowest one.
+    float move_time_s =
+        MAX(RotationalAxisMovement_move_time_s(&(move->a)), RotationalAxisMovement_move_time_s(&(move->b)));
+    move_time_s = MAX(move_time_s, plan_linear_path(m, move, move_time_s));
+    RotationalAxis_set_move_time(&(m->a), &(move->a), move_time_s);
+    RotationalAxis_set_move_time(&(m->b), &(move->b), move_time_s);
+
+    prepare_look_ahead(m, move);
+    if (!move_queue_empty(m)) {
+        struct MachineMove* prev = move_queue_at(m, m->_move_queue_head - 1);
+        move->max_entry_velocity_mm_s = calculate_junction_velocity(prev, move);
+    }
+
+    // Make sure the move is completely written before the step alarm can see it.
+    __dmb();
+    m->_move_queue_head++;
+
+    plan_look_ahead(m);
+    start_stepping(m);
+}
+
+void Machine_move(struct Machine* m, const struct lilg_Command cmd) {
+    struct MachineMove* move = begin_move(m);
+
+#ifdef HAS_XY_AXES
+    if (cmd.X.set) {
+        calculate_linear_axis_move(m, &(m->x), &(move->x), &(m->_planned_position.x), cmd.X);
+    }
+    if (cmd.Y.set) {
+        calculate_linear_axis_move(m, &(m->y), &(move->y), &(m->_planned_position.y), cmd.Y);
+    }
+#endif
+#ifdef HAS_Z_AXIS
+    if (cmd.Z.set) {
+        calculate_linear_axis_move(m, &(m->z), &(move->z), &(m->_planned_position.z), cmd.Z);
+    }
+#endif
+#ifdef HAS_A_AXIS
+    if (LILG_FIELD(cmd, A).set) {
+        move->a = calculate_rotational_axis_move(m, &(m->a), &(m->_planned_position.a), LILG_FIELD(cmd, A));
+    }
+#endif
+#ifdef HAS_B_AXIS
+    if (LILG_FIELD(cmd, B).set) {
+        move->b = calculate_rotational_axis_move(m, &(m->b), &(m->_planned_position.b), LILG_FIELD(cmd, B));
+    }
+#endif
+
+    queue_move(m, move);
+}
+
+void Machine_arc(struct Machine* m __unused, const struct lilg_Command cmd, bool clockwise __unused) {
+#ifdef HAS_XY_AXES
+    float start_x = (float)(m->_planned_position.x) * (1.0f / m->x.steps_per_mm);
+    float start_y = (float)(m->_planned_position.y) * (1.0f / m->y.steps_per_mm);
+    float end_x = cmd.X.set ? linear_axis_destination_mm(m, &(m->x), m->_planned_position.x, cmd.X) : start_x;
+    float end_y = cmd.Y.set ? linear_axis_destination_mm(m, &(m->y), m->_planned_position.y, cmd.Y) : start_y;
+
+    // Work out the arc's center, either from the I & J offsets from the start
+    // or from the radius.
+    float center_x;
+    float center_y;
+    if (LILG_FIELD(cmd, R).set) {
+        float r = lilg_Decimal_to_float(LILG_FIELD(cmd, R));
+        float dx = end_x - start_x;
+        float dy = end_y - start_y;
+        float chord = hypotf(dx, dy);
+        if (chord == 0.0f || chord > 2.0f * fabsf(r)) {
+            report_error_ln("arc radius %0.3f mm can't reach the destination", (double)r);
+            return;
+        }
+        // The center is on the perpendicular bisector of the chord. Positive
+        // radii take the shorter way around, negative radii the longer way.
+        float e = (clockwise != (r < 0.0f)) ? -1.0f : 1.0f;
+        float h = sqrtf(MAX(r * r - chord * chord * 0.25f, 0.0f)) / chord;
+        center_x = (start_x + end_x) * 0.5f - e * h * dy;
+        center_y = (start_y + end_y) * 0.5f + e * h * dx;
+    } else {
+        center_x = start_x + (LILG_FIELD(cmd, I).set ? lilg_Decimal_to_float(LILG_FIELD(cmd, I)) : 0.0f);
+        center_y = start_y + (LILG_FIELD(cmd, J).set ? lilg_Decimal_to_float(LILG_FIELD(cmd, J)) : 0.0f);
+    }
+
+    float radius = hypotf(start_x - center_x, start_y - center_y);
+    if (radius == 0.0f) {
+        report_error_ln("arc has no radius");
+        return;
+    }
+
+    // Angular travel, counter-clockwise is positive. An arc that ends where
+    // it starts is a full circle.
+    float start_angle = atan2f(start_y - center_y, start_x - center_x);
+    float travel = atan2f(end_y - center_y, end_x - center_x) - start_angle;
+    if (clockwise && travel >= 0.0f) {
+        travel -= 2.0f * (float)(M_PI);
+    } else if (!clockwise && travel <= 0.0f) {
+        travel += 2.0f * (float)(M_PI);
+    }
+
+    // Split the arc into chords that stay within ARC_TOLERANCE_MM of it.
+    float segment_mm = 2.0f * sqrtf(ARC_TOLERANCE_MM * MAX(2.0f * radius - ARC_TOLERANCE_MM, 0.0f));
+    segment_mm = MAX(segment_mm, ARC_MIN_SEGMENT_MM);
+    int32_t segments = MAX(1, (int32_t)(ceilf(fabsf(travel) * radius / segment_mm)));
+
+#ifdef HAS_Z_AXIS
+    float start_z = (float)(m->_planned_position.z) * (1.0f / m->z.steps_per_mm);
+    float end_z = cmd.Z.set ? linear_axis_destination_mm(m, &(m->z), m->_planned_position.z, cmd.Z) : start_z;
+#endif
+
+    report_info_ln(
+        "Calculated arc: center %0.3f, %0.3f, radius %0.3f mm, %0.1f deg in %li segments",
+        (double)center_x,
+        (double)center_y,
+        (double)radius,
+        (double)(travel * (180.0f / (float)(M_PI))),
+        segments);
+
+    for (int32_t i = 1; i <= segments; i++) {
+        // The last segment ends exactly at the destination, so rounding
+        // errors don't build up.
+        float x = end_x;
+        float y = end_y;
+        if (i < segments) {
+            float angle = start_angle + travel * (float)(i) / (float)(segments);
+            x = center_x + radius * cosf(angle);
+            y = center_y + radius * sinf(angle);
+        }
+
+        struct MachineMove* move = begin_move(m);
+        calculate_linear_axis_move_to(&(m->x), &(move->x), &(m->_planned_position.x), x);
+        calculate_linear_axis_move_to(&(m->y), &(move->y), &(m->_planned_position.y), y);
+#ifdef HAS_Z_AXIS
+        if (cmd.Z.set) {
+            float z = start_z + (end_z - start_z) * (float)(i) / (float)(segments);
+            calculate_linear_axis_move_to(&(m->z), &(move->z), &(m->_planned_position.z), z);
+        }
+#endif
+        queue_move(m, move);
+    }
+#else
+    report_error_ln("arcs need X and Y axes");
+#endif
+}
+
+// Queues a move of just the given axis to the given position.
+static void queue_linear_axis_move_to(struct Machine* m, struct LinearAxis* axis __unused, float dest_mm __unused) {
+    struct MachineMove* move = begin_move(m);
+
+#ifdef HAS_XY_AXES
+    if (axis == &(m->x)) {
+        calculate_linear_axis_move_to(axis, &(move->x), &(m->_planned_position.x), dest_mm);
+    }
+    if (axis == &(m->y)) {
+        calculate_linear_axis_move_to(axis, &(move->y), &(m->_planned_position.y), dest_mm);
+    }
+#endif
+#ifdef HAS_Z_AXIS
+    if (axis == &(m->z)) {
+        calculate_linear_axis_move_to(axis, &(move->z), &(m->_planned_position.z), dest_mm);
+    }
+#endif
+
+    queue_move(m, move);
+}
+
+struct StallGuardSamples {
+    uint32_t count;
+    uint32_t total;
+    uint16_t min;
+    uint16_t max;
+};
+
+static void sample_stallguard(struct Stepper* s, struct StallGuardSamples* samples) {
+    uint16_t sg_result;
+    if (Stepper_read_stallguard_result(s, &sg_result)) {
+        samples->count++;
+        samples->total += sg_result;
+        samples->min = MIN(samples->min, sg_result);
+        samples->max = MAX(samples->max, sg_result);
+    }
+}
+
+// Samples both of the axis' motors, but only between the given times.
+// Waits for the step alarm to start the streams for moves that were queued
+// while the machine was stopped, and returns when the streams' timeline began
+// in real time. The moves' first steps are timed from then, which is a little
+// later than the step alarm being set off.
+static absolute_time_t wait_for_streams_to_start(struct Machine* m, uint32_t stream_starts) {
+    while (m->_stream_starts == stream_starts) {}
+    __dmb();
+    return m->_stream_started_at;
+}
+
+static void sample_axis_stallguard(
+    struct LinearAxis* axis, absolute_time_t from, absolute_time_t until, struct StallGuardSamples* samples) {
+    absolute_time_t now = get_absolute_time();
+    if (absolute_time_diff_us(from, now) < 0 || absolute_time_diff_us(now, until) < 0) {
+        return;
+    }
+    sample_stallguard(axis->stepper, samples);
+    if (axis->stepper2 != NULL) {
+        sample_stallguard(axis->stepper2, samples);
+    }
+}
+
+void Machine_resonance_sweep(struct Machine* m, const struct lilg_Command cmd) {
+    struct LinearAxis* axis = tuned_linear_axis(m, cmd);
+    if (axis == NULL) {
+        report_error_ln("resonance sweep needs an axis");
+        return;
+    }
+
+    float start_hz = RESONANCE_SWEEP_START_HZ;
+    float end_hz = RESONANCE_SWEEP_END_HZ;
+    float step_hz = RESONANCE_SWEEP_STEP_HZ;
+    float acceleration_per_hz = RESONANCE_SWEEP_ACCELERATION_PER_HZ;
+    int32_t cycles = RESONANCE_SWEEP_CYCLES;
+    if (LILG_FIELD(cmd, S).set) {
+        start_hz = lilg_Decimal_to_float(LILG_FIELD(cmd, S));
+    }
+    if (LILG_FIELD(cmd, E).set) {
+        end_hz = lilg_Decimal_to_float(LILG_FIELD(cmd, E));
+    }
+    if (LILG_FIELD(cmd, I).set) {
+        step_hz = lilg_Decimal_to_float(LILG_FIELD(cmd, I));
+    }
+    if (LILG_FIELD(cmd, P).set) {
+        acceleration_per_hz = lilg_Decimal_to_float(LILG_FIELD(cmd, P));
+    }
+    if (LILG_FIELD(cmd, C).set) {
+        cycles = LILG_FIELD(cmd, C).real;
+    }
+
+    if (!(start_hz > 0.0f && end_hz >= start_hz && step_hz > 0.0f && acceleration_per_hz > 0.0f && cycles > 0)) {
+        report_error_ln("invalid resonance sweep settings");
+        return;
+    }
+
+    Machine_wait_for_moves(m);
+    report_info_ln("sweeping %c axis from %0.1f Hz to %0.1f Hz...", axis->name, (double)(start_hz), (double)(end_hz));
+
+    float old_velocity = axis->velocity_mm_s;
+    float old_acceleration = axis->acceleration_mm_s2;
+    float old_jerk = axis->jerk_mm_s3;
+    float origin_mm = LinearAxis_get_position_mm(axis);
+
+    // StallGuard only measures the load in StealthChop.
+    Stepper_enable_stealthchop(axis->stepper);
+    if (axis->stepper2 != NULL) {
+        Stepper_enable_stealthchop(axis->stepper2);
+    }
+
+    uint32_t frequency_count = (uint32_t)(floorf((end_hz - start_hz) / step_hz)) + 1;
+    for (uint32_t i = 0; i < frequency_count; i++) {
+        float frequency_hz = start_hz + step_hz * (float)(i);
+
+        // Each stroke accelerates for half of its time and decelerates for
+        // the other half, so a stroke that takes half a period covers
+        // a / (16 f^2).
+        float acceleration_mm_s2 = acceleration_per_hz * frequency_hz;
+        float stroke_mm = acceleration_mm_s2 / (16.0f * frequency_hz * frequency_hz);
+        axis->acceleration_mm_s2 = acceleration_mm_s2;
+        // This is twice the stroke's peak velocity, so it never coasts.
+        axis->velocity_mm_s = acceleration_mm_s2 / (2.0f * frequency_hz);
+        axis->jerk_mm_s3 = 0.0f;
+
+        // The strokes are streamed back to back by the step alarm, so the
+        // axis oscillates without stopping and the drivers can be read while
+        // it moves. The first cycle is left out while the oscillation builds
+        // up, the sampling window is lined up with the streams once the first
+        // stroke has started.
+        uint64_t period_us = (uint64_t)(1000000.0f / frequency_hz);
+        uint32_t stream_starts = m->_stream_starts;
+        absolute_time_t sample_from = at_the_end_of_time;
+        absolute_time_t sample_until = at_the_end_of_time;
+
+        struct StallGuardSamples samples = {.min = UINT16_MAX};
+        for (uint32_t stroke = 0; stroke < 2 * (uint32_t)(cycles); stroke++) {
+            while (move_queue_full(m)) { sample_axis_stallguard(axis, sample_from, sample_until, &samples); }
+            queue_linear_axis_move_to(m, axis, stroke % 2 == 0 ? origin_mm + stroke_mm : origin_mm);
+
+            if (stroke == 0) {
+                absolute_time_t start = wait_for_streams_to_start(m, stream_starts);
+                sample_from = delayed_by_us(start, period_us);
+                sample_until = delayed_by_us(start, (uint64_t)(cycles) * period_us);
+            }
+        }
+        while (m->_stepping) { sample_axis_stallguard(axis, sample_from, sample_until, &samples); }
+
+        if (samples.count == 0) {
+            report_error_ln("unable to read SG_RESULT at %0.1f Hz", (double)(frequency_hz));
+            continue;
+        }
+
+        // Lower SG_RESULT values mean more load, the frequencies where it dips
+        // are the ones that the axis resonates at.
+        report_result_ln(
+            "F:%0.1f stroke:%0.3f SG:%lu min:%u max:%u",
+            (double)(frequency_hz),
+            (double)(stroke_mm),
+            samples.total / samples.count,
+            samples.min,
+            samples.max);
+    }
+
+    Stepper_disable_stealthchop(axis->stepper);
+    if (axis->stepper2 != NULL) {
+        Stepper_disable_stealthchop(axis->stepper2);
+    }
+
+    axis->velocity_mm_s = old_velocity;
+    axis->acceleration_mm_s2 = old_acceleration;
+    axis->jerk_mm_s3 = old_jerk;
+}
+
+void Machine_calibrate_stallguard(struct Machine* m, const struct lilg_Command cmd) {
+    struct LinearAxis* axis = tuned_linear_axis(m, cmd);
+    if (axis == NULL) {
+        report_error_ln("StallGuard calibration needs an axis");
+        return;
+    }
+
+    float distance_mm = STALLGUARD_CALIBRATION_DISTANCE_MM;
+    if (LILG_FIELD(cmd, D).set) {
+        distance_mm = lilg_Decimal_to_float(LILG_FIELD(cmd, D));
+    }
+
+    // Only the part of the move at the homing velocity is sampled, the
+    // motor's load is different while it accelerates.
+    float velocity_mm_s = axis->homing_velocity_mm_s;
+    float move_time_s =
+        LinearAxis_move_time_s(distance_mm, velocity_mm_s, axis->homing_acceleration_mm_s2, axis->jerk_mm_s3);
+    float ramp_time_s = move_time_s - distance_mm / velocity_mm_s;
+    if (!(distance_mm > 0.0f && move_time_s > 2.0f * ramp_time_s)) {
+        report_error_ln("StallGuard calibration needs to move far enough to reach the homing velocity");
+        return;
+    }
+
+    Machine_wait_for_moves(m);
+
+    float old_velocity = axis->velocity_mm_s;
+    float old_acceleration = axis->acceleration_mm_s2;
+    axis->velocity_mm_s = velocity_mm_s;
+    axis->acceleration_mm_s2 = axis->homing_acceleration_mm_s2;
+
+    // StallGuard only measures the load in StealthChop.
+    Stepper_enable_stealthchop(axis->stepper);
+    if (axis->stepper2 != NULL) {
+        Stepper_enable_stealthchop(axis->stepper2);
+    }
+
+    // Move away from home and back again. The moves are streamed by the step
+    // alarm, so reading the drivers doesn't hold up the steps like it would
+    // for homing's direct steps.
+    struct StallGuardSamples samples = {.min = UINT16_MAX};
+    float start_mm = LinearAxis_get_position_mm(axis);
+    float dest_mm[2] = {start_mm - axis->homing_direction * distance_mm, start_mm};
+    uint64_t ramp_time_us = (uint64_t)(ramp_time_s * 1000000.0f);
+    uint64_t coast_time_us = (uint64_t)((move_time_s - 2.0f * ramp_time_s) * 1000000.0f);
+    for (size_t i = 0; i < 2; i++) {
+        uint32_t stream_starts = m->_stream_starts;
+        queue_linear_axis_move_to(m, axis, dest_mm[i]);
+
+        // The machine was stopped, so the move starts along with the streams.
+        absolute_time_t coast_start = delayed_by_us(wait_for_streams_to_start(m, stream_starts), ramp_time_us);
+        absolute_time_t coast_end = delayed_by_us(coast_start, coast_time_us);
+        while (absolute_time_diff_us(get_absolute_time(), coast_end) > 0) {
+            sample_axis_stallguard(axis, coast_start, coast_end, &samples);
+        }
+
+        Machine_wait_for_moves(m);
+    }
+
+    Stepper_disable_stealthchop(axis->stepper);
+    if (axis->stepper2 != NULL) {
+        Stepper_disable_stealthchop(axis->stepper2);
+    }
+
+    axis->velocity_mm_s = old_velocity;
+    axis->acceleration_mm_s2 = old_acceleration;
+
+    if (samples.count == 0) {
+        report_error_ln("unable to read SG_RESULT");
+        return;
+    }
+
+    // A stall is signaled once SG_RESULT drops to twice the threshold, so the
+    // threshold is set to stall once the load takes the result below a
+    // fraction of the lowest value seen while moving freely.
+    float threshold = (float)(samples.min) * 0.5f * STALLGUARD_CALIBRATION_MARGIN;
+    axis->homing_sensitivity = (uint8_t)(MIN(threshold, 255.0f));
+
+    report_result_ln(
+        "%c:%u SG:%lu min:%u", axis->name, axis->homing_sensitivity, samples.total / samples.count, samples.min);
+}
+
+bool __not_in_flash_func(Machine_step)(struct Machine* m) {
+    if (!axes_moving(m)) {
+        if (!start_next_move(m)) {
+            // Everything's been stepped, but the shaped steps might still
+            // need to play out.
+            return drain_shapers(m);
+        }
+    }
+
+    step_linear_axes(m);
+#ifdef HAS_A_AXIS
+    RotationalAxis_queue_step(&(m->a), m->_step_horizon);
+#endif
+#ifdef HAS_B_AXIS
+    RotationalAxis_queue_step(&(m->b), m->_step_horizon);
+#endif
+    drain_shapers(m);
+
+    return true;
+}
+
+void Machine_wait_for_moves(struct Machine* m) {
+    while (m->_stepping) {}
+}
+
+void Machine_abort_moves(struct Machine* m) {
+    // Steps are generated in the step alarm (which might be running on the
+    // other core) so ask it to stop and wait for it to do so.
+    m->_abort_requested = true;
+    __dmb();
+    if (m->_stepping) {
+        set_step_alarm(m, make_timeout_time_us(10));
+    }
+
+    while (m->_stepping) {}
+
+    // The step alarm could've finished on its own before it noticed, either
+    // way make sure that everything is stopped.
+    stop_stepping(m);
+
+    sync_planned_position(m);
+}
+
+void Machine_report_position(struct Machine* m) {
+    report_result("position:");
+#ifdef HAS_XY_AXES
+    report_result(
+        " X:%0.3f Y:%0.3f", (double)LinearAxis_get_position_mm(&(m->x)), (double)LinearAxis_get_position_mm(&(m->y)));
+#endif
+#ifdef HAS_Z_AXIS
+    report_result(" Z:%0.3f", (double)LinearAxis_get_position_mm(&(m->z)));
+#endif
+#ifdef HAS_A_AXIS
+    report_result(" A:%0.1f", (double)RotationalAxis_get_position_deg(&(m->a)));
+#endif
+#ifdef HAS_B_AXIS
+    report_result(" B:%0.1f", (double)RotationalAxis_get_position_deg(&(m->b)));
+#endif
+    report_result(" count:");
+#ifdef HAS_XY_AXES
+    report_result(" X:%li Y:%li", m->x.stepper->total_steps, m->y.stepper->total_steps);
+#endif
+#ifdef HAS_Z_AXIS
+    report_result(" Z:%li", m->y.stepper->total_steps);
+#endif
+#ifdef HAS_A_AXIS
+    report_result(" A:%li", m->a.stepper->total_steps);
+#endif
+#ifdef HAS_B_AXIS
+    report_result(" B:%li", m->z.stepper->total_steps);
+#endif
+    report_result_ln("");
+}
+
+void Machine_report_missed_deadlines(struct Machine* m) {
+    report_result("missed deadlines:");
+#ifdef HAS_XY_AXES
+    report_result(" X:%lu Y:%lu", m->x.stepper->missed_deadlines, m->y.stepper->missed_deadlines);
+#endif
+#ifdef HAS_Z_AXIS
+    report_result(" Z:%lu", m->z.stepper->missed_deadlines);
+#endif
+#ifdef HAS_A_AXIS
+    report_result(" A:%lu", m->a.stepper->missed_deadlines);
+#endif
+#ifdef HAS_B_AXIS
+    report_result(" B:%lu", m->b.stepper->missed_deadlines);
+#endif
+    report_result_ln("");
+}
+
+void Machine_set_position(struct Machine* m, const struct lilg_Command cmd) {
+    Machine_wait_for_moves(m);
+
 #ifdef HAS_XY_AXES
     if (cmd.X.set) {
         LinearAxis_set_position_mm(&(m->x), lilg_Decimal_to_float(cmd.X));
@@ -363,6 +1847,7 @@ void Machine_set_position(struct Machine* m, const struct lilg_Command cmd) {
     }
 #endif
 
+    sync_planned_position(m);
     Machine_report_position(m);
 }
 
@@ -6,30 +6,163 @@ https://opensource.org/licenses/MIT. */
 
 #pragma once
 
+#include "config/motion.h"
 #include "drivers/tmc2209.h"
 #include "drivers/tmc2209_helper.h"
 #include "drivers/tmc_uart.h"
 #include "littleg/littleg.h"
-#include "motion/bresenham.h"
+#include "motion/dda.h"
+#include "motion/input_shaper.h"
 #include "motion/linear_axis.h"
 #include "motion/rotational_axis.h"
 #include "motion/stepper.h"
+#include <assert.h>
+
+#define MACHINE_STEPPER_COUNT 3
+
+// How many moves can be queued up ahead of the move that's currently being
+// executed. Note that one slot is always kept free, so that the last move
+// that was started is still around for the look-ahead planner.
+#define MACHINE_MOVE_QUEUE_SIZE 8
+
+// The move queue's positions are counters that wrap around, so they only map
+// onto slots consistently when the size is a power of two.
+static_assert(
+    (MACHINE_MOVE_QUEUE_SIZE & (MACHINE_MOVE_QUEUE_SIZE - 1)) == 0, "The move queue's size must be a power of two");
+
+// Each queued move can use two profiles for an axis: the axis' own, and the
+// major axis' share of the path's limits.
+static_assert(
+    LINEAR_AXIS_PROFILE_CACHE_SIZE > 2 * MACHINE_MOVE_QUEUE_SIZE,
+    "Every queued move needs to be able to keep its acceleration profiles");
+
+// A planned G0/G1 move waiting in the move queue.
+struct MachineMove {
+    struct LinearAxisMovement x;
+    struct LinearAxisMovement y;
+    struct LinearAxisMovement z;
+    struct RotationalAxisMovement a;
+    struct RotationalAxisMovement b;
+
+    /* Look-ahead planning */
+    // The axis (and its movement) that sets the pace for the move. This is
+    // NULL for moves that can't be joined with the moves around them.
+    struct LinearAxis* drive_axis;
+    struct LinearAxisMovement* drive_move;
+    // Direction of travel through X, Y, and Z as a unit vector.
+    float unit_vector[3];
+    // Length of the move's path
+    float distance_mm;
+    // Velocity and acceleration along the path
+    float nominal_velocity_mm_s;
+    float acceleration_mm_s2;
+    // Converts velocity along the path into velocity of the drive axis.
+    float drive_ratio;
+    // Fastest the move can be entered at based on the corner between it and
+    // the previous move.
+    float max_entry_velocity_mm_s;
+    // Velocities that the drive axis' profile was calculated with.
+    float entry_velocity_mm_s;
+    float exit_velocity_mm_s;
+};
+
+// Entry and exit velocities that the look-ahead planner worked out for a
+// queued move, and the drive axis' matching offsets into its ramp.
+struct MachinePlannedMove {
+    float entry_velocity_mm_s;
+    float exit_velocity_mm_s;
+    int32_t entry_step_offset;
+    int32_t exit_step_offset;
+};
+
+// The look-ahead planner's results for all of the moves that haven't started
+// yet. The planner publishes these and the step alarm takes a copy of them
+// when it starts a move, so that neither has to wait on the other.
+struct MachinePlan {
+    // Incremented before and after the plan is written, so it's odd while
+    // the plan is being changed.
+    volatile uint32_t version;
+    // Position of the first move in the plan, and how many moves it covers.
+    size_t first_move;
+    size_t move_count;
+    // Indexed the same as the move queue.
+    struct MachinePlannedMove moves[MACHINE_MOVE_QUEUE_SIZE];
+};
+
+// Axis positions, in steps, that the machine will be at once all queued moves
+// are finished.
+struct MachinePosition {
+    int32_t x;
+    int32_t y;
+    int32_t z;
+    int32_t a;
+    int32_t b;
+};
 
 struct Machine {
-    struct TMC2209 tmc[3];
-    struct Stepper stepper[3];
+    struct TMC2209 tmc[MACHINE_STEPPER_COUNT];
+    struct Stepper stepper[MACHINE_STEPPER_COUNT];
     struct LinearAxis x;
     struct LinearAxis y;
     struct LinearAxis z;
     struct RotationalAxis a;
     struct RotationalAxis b;
+#ifdef HAS_XY_AXES
+    // Input shapers for the gantry, configured with M593.
+    struct InputShaper x_shaper;
+    struct InputShaper y_shaper;
+#endif
     bool absolute_positioning;
 
     /* State */
-    bool _is_coordinated_move;
+    // The linear axis that's timed during the current move, and the linear
+    // axes that follow along with it. _major_axis is NULL when the current
+    // move doesn't use any linear axes.
     struct LinearAxis* _major_axis;
-    struct LinearAxis* _minor_axis;
-    struct Bresenham _bresenham;
+    struct LinearAxis* _minor_axes[DDA_MAX_MINOR_AXES];
+    struct DDA _dda;
+
+    /* Move queue */
+    struct MachineMove _move_queue[MACHINE_MOVE_QUEUE_SIZE];
+    // Positions in the queue are counters that wrap around, the move at a
+    // position is in slot position % MACHINE_MOVE_QUEUE_SIZE. Each counter
+    // only has one writer, so the queue doesn't need a lock even though the
+    // step alarm might be running on the other core.
+    // Position where the next planned move will be placed. Only changed by
+    // the main loop.
+    volatile size_t _move_queue_head;
+    // Position of the next move to start. Only changed by the step alarm.
+    volatile size_t _move_queue_next;
+    // Position of the oldest move that's still using its slot, the current
+    // move if there is one. Only changed by the step alarm.
+    volatile size_t _move_queue_tail;
+    struct MachineMove* _current_move;
+    // The plan published by the look-ahead planner, and the step alarm's
+    // copies of it. The step alarm swaps between its copies so that it
+    // always has a consistent plan to fall back on.
+    struct MachinePlan _plan;
+    struct MachinePlan _step_plans[2];
+    size_t _step_plan;
+    struct MachinePosition _planned_position;
+
+    /* Step generation */
+    int _step_alarm;
+    // Set while the step alarm is working through the queue.
+    volatile bool _stepping;
+    // Set while the steppers' streams are running, and once everything has
+    // been queued and the streams are just playing out.
+    bool _streaming;
+    bool _stream_finishing;
+    // When the streams' timeline begins, and when the PIO actually started
+    // playing it.
+    absolute_time_t _stream_origin;
+    absolute_time_t _stream_started_at;
+    // Counts how many times the streams have been started, so that the main
+    // loop can tell when _stream_started_at is for the moves it just queued.
+    volatile uint32_t _stream_starts;
+    // Steps up until this time are being queued.
+    absolute_time_t _step_horizon;
+    volatile bool _abort_requested;
 };
 
 void Machine_init(struct Machine* m);
@@ -39,11 +172,34 @@ void Machine_disable_steppers(struct Machine* m);
 void Machine_set_linear_velocity(struct Machine* m, float vel_mm_s);
 void Machine_set_linear_acceleration(struct Machine* m, float accel_mm_s2);
 void Machine_report_linear_acceleration(struct Machine* m);
+void Machine_set_rotational_velocity(struct Machine* m, const struct lilg_Command cmd);
+void Machine_report_rotational_velocity(struct Machine* m);
+void Machine_set_rotational_acceleration(struct Machine* m, const struct lilg_Command cmd);
+void Machine_report_rotational_acceleration(struct Machine* m);
+void Machine_set_linear_jerk(struct Machine* m, const struct lilg_Command cmd);
+void Machine_report_linear_jerk(struct Machine* m);
+void Machine_set_input_shaping(struct Machine* m, const struct lilg_Command cmd);
+void Machine_report_input_shaping(struct Machine* m);
 void Machine_set_motor_current(struct Machine* m, const struct lilg_Command cmd);
 void Machine_set_homing_sensitivity(struct Machine* m, const struct lilg_Command cmd);
 void Machine_home(struct Machine* m, bool x, bool y, bool z);
+// Sweeps an axis through a range of frequencies and reports the StallGuard
+// load at each one (M958).
+void Machine_resonance_sweep(struct Machine* m, const struct lilg_Command cmd);
+// Finds the highest acceleration that an axis can manage without stalling
+// (M959).
+void Machine_tune_acceleration(struct Machine* m, const struct lilg_Command cmd);
+// Measures an axis' StallGuard load while moving freely at the homing
+// velocity, and sets its homing sensitivity just below it (M960).
+void Machine_calibrate_stallguard(struct Machine* m, const struct lilg_Command cmd);
 void Machine_move(struct Machine* m, const struct lilg_Command cmd);
+// Moves along an arc in the XY plane (G2/G3), the arc is split into straight
+// moves that go through the move queue like any other move.
+void Machine_arc(struct Machine* m, const struct lilg_Command cmd, bool clockwise);
+void Machine_wait_for_moves(struct Machine* m);
+void Machine_abort_moves(struct Machine* m);
 void Machine_report_position(struct Machine* m);
+void Machine_report_missed_deadlines(struct Machine* m);
 void Machine_set_position(struct Machine* m, const struct lilg_Command cmd);
 void Machine_report_tmc_info(struct Machine* m);
-int64_t Machine_step(struct Machine* m);
+bool Machine_step(struct Machine* m);
@@ -38,6 +38,7 @@ static struct FeedersState feeders;
 #endif
 
 static void process_incoming_char(char c);
+static bool runs_alongside_moves(struct lilg_Command cmd);
 static void run_g_command(struct lilg_Command cmd);
 static void run_m_command(struct lilg_Command cmd);
 
@@ -125,6 +126,13 @@ static void process_incoming_char(char c) {
         return;
     }
 
+    // Moves are queued and executed in the background, so most commands need
+    // to wait for them to finish first. Otherwise, for example, a valve could
+    // be switched with M42 before the nozzle has arrived.
+    if (!runs_alongside_moves(cmd)) {
+        Machine_wait_for_moves(&machine);
+    }
+
     switch (cmd.first_field) {
         case 'G': {
             run_g_command(cmd);
@@ -142,6 +150,44 @@ static void process_incoming_char(char c) {
     okay();
 }
 
+static bool runs_alongside_moves(struct lilg_Command cmd) {
+    switch (cmd.first_field) {
+        case 'G': {
+            switch (cmd.G.real) {
+                // Moves go into the move queue, and units & positioning mode
+                // only affect how new moves are planned.
+                case 0:
+                case 1:
+                case 2:
+                case 3:
+                case 21:
+                case 90:
+                case 91:
+                    return true;
+                default:
+                    return false;
+            }
+        } break;
+
+        case 'M': {
+            switch (cmd.M.real) {
+                // Emergency stop has to happen right away and reports don't
+                // change anything.
+                case 82:
+                case 112:
+                case 114:
+                case 115:
+                    return true;
+                default:
+                    return false;
+            }
+        } break;
+
+        default:
+            return false;
+    }
+}
+
 static void run_g_command(struct lilg_Command cmd) {
     switch (cmd.G.real) {
         // Linear move
@@ -157,6 +203,20 @@ static void run_g_command(struct lilg_Command cmd) {
             Machine_move(&machine, cmd);
         } break;
 
+        // Arc or circle move
+        // https://marlinfw.org/docs/gcode/G002-G003.html
+        // G2 is clockwise, G3 counter-clockwise. The center is given by the
+        // I and J offsets from the current position or by the radius R.
+        case 2:
+        case 3: {
+            if (LILG_FIELD(cmd, F).set) {
+                float vel_mm_s = lilg_Decimal_to_float(LILG_FIELD(cmd, F)) / 60.0f;
+                Machine_set_linear_velocity(&machine, vel_mm_s);
+            }
+
+            Machine_arc(&machine, cmd, cmd.G.real == 2);
+        } break;
+
         // Millimeter Units
         // https://marlinfw.org/docs/gcode/G21.html
         // OpenPnP sends this as part of CONNECT_COMMAND by default.
@@ -231,6 +291,7 @@ static void run_m_command(struct lilg_Command cmd) {
         // https://marlinfw.org/docs/gcode/M112.html
         case 112: {
             // disable all movement
+            Machine_abort_moves(&machine);
             Machine_disable_steppers(&machine);
 
 #ifdef STARFISH
@@ -319,8 +380,19 @@ static void run_m_command(struct lilg_Command cmd) {
             Neopixel_write(pixels, NUM_PIXELS);
         } break;
 
+        // M203 Set Max Feedrate
+        // https://marlinfw.org/docs/gcode/M203.html
+        // Only A and B are supported, in deg/s. The linear axes' velocity is
+        // set with G0/G1's F parameter.
+        case 203: {
+            Machine_set_rotational_velocity(&machine, cmd);
+            Machine_report_rotational_velocity(&machine);
+        } break;
+
         // M204 Set Starting Acceleration
         // https://marlinfw.org/docs/gcode/M204.html
+        // Non-standard: A and B set the rotational axes' acceleration in
+        // deg/s^2.
         case 204: {
             float accel = 0;
             bool set = false;
@@ -337,6 +409,20 @@ static void run_m_command(struct lilg_Command cmd) {
                 Machine_set_linear_acceleration(&machine, accel);
             }
             Machine_report_linear_acceleration(&machine);
+            if (LILG_FIELD(cmd, A).set || LILG_FIELD(cmd, B).set) {
+                Machine_set_rotational_acceleration(&machine, cmd);
+                Machine_report_rotational_acceleration(&machine);
+            }
+        } break;
+
+        // M205 Set jerk limit
+        // https://marlinfw.org/docs/gcode/M205.html
+        // Non-standard: X, Y, and Z set each axis' maximum jerk in mm/s^3,
+        // 0 switches the axis back to a constant acceleration (trapezoidal)
+        // profile.
+        case 205: {
+            Machine_set_linear_jerk(&machine, cmd);
+            Machine_report_linear_jerk(&machine);
         } break;
 
         // M260 I2C Send
@@ -376,7 +462,7 @@ static void run_m_command(struct lilg_Command cmd) {
         // M400: Finish moves
         // https://marlinfw.org/docs/gcode/M400.html
         case 400: {
-            // no-op since Fishfood does not reply to G0/G1 until moves are finished.
+            Machine_wait_for_moves(&machine);
         } break;
 
 #ifdef HAS_RS485
@@ -414,10 +500,22 @@ static void run_m_command(struct lilg_Command cmd) {
         // https://marlinfw.org/docs/gcode/M503.html
         case 503: {
             Machine_report_linear_acceleration(&machine);
+            Machine_report_linear_jerk(&machine);
             Machine_report_position(&machine);
+            Machine_report_missed_deadlines(&machine);
             Machine_report_tmc_info(&machine);
         } break;
 
+        // M593 Input Shaping
+        // https://marlinfw.org/docs/gcode/M593.html
+        // F sets the ringing frequency (0 turns shaping off) and D the
+        // damping ratio, for the X and/or Y axes. Non-standard: T picks the
+        // shaper, 1 for ZV, 2 for ZVD, or 3 for MZV.
+        case 593: {
+            Machine_set_input_shaping(&machine, cmd);
+            Machine_report_input_shaping(&machine);
+        } break;
+
         // M906 Set motor current
         // https://marlinfw.org/docs/gcode/M906.html
         case 906: {
@@ -430,6 +528,32 @@ static void run_m_command(struct lilg_Command cmd) {
             Machine_set_homing_sensitivity(&machine, cmd);
         } break;
 
+        // M958 Resonance sweep
+        // Non-standard: oscillates the given axis (X, Y, or Z) at frequencies
+        // from S to E Hz in steps of I Hz, accelerating at P mm/s^2 per Hz,
+        // for C cycles each, and reports the StallGuard load at each one.
+        case 958: {
+            Machine_resonance_sweep(&machine, cmd);
+        } break;
+
+        // M959 Tune acceleration
+        // Non-standard: moves the given axis (X, Y, or Z) back and forth D mm
+        // C times at each acceleration from S to E mm/s^2 in steps of I
+        // mm/s^2, stopping once StallGuard catches a stall, and reports the
+        // highest acceleration that didn't stall. W1 applies it to the axis,
+        // less a safety margin.
+        case 959: {
+            Machine_tune_acceleration(&machine, cmd);
+        } break;
+
+        // M960 Calibrate StallGuard
+        // Non-standard: moves the given axis (X, Y, or Z) D mm away from home
+        // and back at its homing velocity, and sets its homing sensitivity
+        // (see M914) from the StallGuard load measured along the way.
+        case 960: {
+            Machine_calibrate_stallguard(&machine, cmd);
+        } break;
+
         // M997 firmware update
         // https://marlinfw.org/docs/gcode/M997.html
         case 997: {
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The most axes that can follow the major axis in a coordinated move.
+#define DDA_MAX_MINOR_AXES 4
+
+// Digital differential analyzer for moving several axes along a straight
+// line. The major axis (the one moving the most) steps every time and each
+// minor axis accumulates its share of a step, stepping whenever that adds up
+// to a whole step.
+struct DDA {
+    // Number of steps that the major axis takes.
+    int32_t major_steps;
+    // Number of steps that each minor axis takes.
+    int32_t minor_steps[DDA_MAX_MINOR_AXES];
+    size_t minor_count;
+
+    // error accumulators, in units of 1 / major_steps of a step.
+    int32_t _error[DDA_MAX_MINOR_AXES];
+};
+
+static inline void DDA_init(struct DDA* d, int32_t major_steps) {
+    d->major_steps = major_steps;
+    d->minor_count = 0;
+}
+
+// Adds a minor axis that takes the given number of steps, which can't be more
+// than the major axis takes. Returns the minor axis' index.
+static inline size_t DDA_add_minor(struct DDA* d, int32_t steps) {
+    size_t i = d->minor_count++;
+    d->minor_steps[i] = steps;
+    // Starting halfway through a step centers the minor axis' steps between
+    // the major axis' steps, and it still takes exactly the given number of
+    // steps by the end.
+    d->_error[i] = d->major_steps / 2;
+    return i;
+}
+
+// Advances the major axis by a step, returns a bitmask of the minor axes that
+// need to step along with it.
+static inline uint32_t DDA_step(struct DDA* d) {
+    uint32_t stepped = 0;
+
+    for (size_t i = 0; i < d->minor_count; i++) {
+        d->_error[i] -= d->minor_steps[i];
+        if (d->_error[i] < 0) {
+            d->_error[i] += d->major_steps;
+            stepped |= 1u << i;
+        }
+    }
+
+    return stepped;
+}
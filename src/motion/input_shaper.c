@@ -0,0 +1,255 @@
+#include "input_shaper.h"
+#include "hardware/platform_defs.h"
+#include <math.h>
+#include <stdlib.h>
+
+static bool play_next_impulse(struct InputShaper* s, int32_t until);
+
+/*
+    Public methods
+*/
+
+void InputShaper_init(struct InputShaper* s, struct Stepper* stepper, struct Stepper* stepper2) {
+    s->stepper = stepper;
+    s->stepper2 = stepper2;
+    InputShaper_configure(s, INPUT_SHAPER_NONE, 0.0f, 0.0f, 0.0f);
+}
+
+bool InputShaper_configure(
+    struct InputShaper* s, enum InputShaperType type, float frequency_hz, float damping_ratio, float max_step_rate_hz) {
+    if (type != INPUT_SHAPER_NONE && !(frequency_hz > 0.0f && damping_ratio >= 0.0f && damping_ratio < 1.0f)) {
+        return false;
+    }
+
+    // See "Input shaping for vibration reduction" by Singer & Seering, the
+    // impulses are spread out over the damped period of the ringing.
+    float df = sqrtf(1.0f - damping_ratio * damping_ratio);
+    float period_s = type != INPUT_SHAPER_NONE ? 1.0f / (frequency_hz * df) : 0.0f;
+    float k = expf(-damping_ratio * (float)(M_PI) / df);
+    float weights[INPUT_SHAPER_MAX_IMPULSES];
+    float delays[INPUT_SHAPER_MAX_IMPULSES];
+    size_t count;
+
+    switch (type) {
+        case INPUT_SHAPER_ZV:
+            count = 2;
+            weights[0] = 1.0f;
+            weights[1] = k;
+            delays[0] = 0.0f;
+            delays[1] = 0.5f * period_s;
+            break;
+
+        case INPUT_SHAPER_ZVD:
+            count = 3;
+            weights[0] = 1.0f;
+            weights[1] = 2.0f * k;
+            weights[2] = k * k;
+            delays[0] = 0.0f;
+            delays[1] = 0.5f * period_s;
+            delays[2] = period_s;
+            break;
+
+        case INPUT_SHAPER_MZV:
+            k = expf(-0.75f * damping_ratio * (float)(M_PI) / df);
+            count = 3;
+            weights[0] = 1.0f - 1.0f / sqrtf(2.0f);
+            weights[1] = (sqrtf(2.0f) - 1.0f) * k;
+            weights[2] = weights[0] * k * k;
+            delays[0] = 0.0f;
+            delays[1] = 0.375f * period_s;
+            delays[2] = 0.75f * period_s;
+            break;
+
+        default:
+            count = 1;
+            weights[0] = 1.0f;
+            delays[0] = 0.0f;
+            break;
+    }
+
+    // Every step within the longest delay has to fit in the history, along
+    // with the one that's being added.
+    if (max_step_rate_hz * delays[count - 1] > (float)(INPUT_SHAPER_HISTORY_SIZE - 2)) {
+        return false;
+    }
+
+    s->type = type;
+    s->frequency_hz = frequency_hz;
+    s->damping_ratio = damping_ratio;
+
+    float total = 0.0f;
+    for (size_t i = 0; i < count; i++) { total += weights[i]; }
+
+    // The last impulse gets whatever's left over, so that the weights add up
+    // to exactly one step.
+    int32_t remaining = INPUT_SHAPER_WEIGHT_ONE;
+    for (size_t i = 0; i < count; i++) {
+        s->_impulse_delay_us[i] = (uint32_t)(lroundf(delays[i] * 1000000.0f));
+        s->_impulse_weight[i] =
+            i + 1 < count ? (int32_t)(lroundf(weights[i] / total * INPUT_SHAPER_WEIGHT_ONE)) : remaining;
+        remaining -= s->_impulse_weight[i];
+    }
+    s->_impulse_count = count;
+
+    InputShaper_reset(s);
+    return true;
+}
+
+float InputShaper_max_step_rate_hz(struct InputShaper* s) {
+    uint32_t longest_delay_us = s->_impulse_delay_us[s->_impulse_count - 1];
+    if (longest_delay_us == 0) {
+        return INFINITY;
+    }
+    return (float)(INPUT_SHAPER_HISTORY_SIZE - 2) * 1000000.0f / (float)(longest_delay_us);
+}
+
+const char* InputShaper_type_name(enum InputShaperType type) {
+    switch (type) {
+        case INPUT_SHAPER_ZV:
+            return "ZV";
+        case INPUT_SHAPER_ZVD:
+            return "ZVD";
+        case INPUT_SHAPER_MZV:
+            return "MZV";
+        default:
+            return "none";
+    }
+}
+
+void __not_in_flash_func(InputShaper_queue_step)(struct InputShaper* s, int8_t direction, absolute_time_t at) {
+    // If the history is full the step isn't shaped, it's added to the shaped
+    // position as a whole and goes out along with the next impulse. The
+    // older steps' impulses are due after this one, so playing them early
+    // would put them out of order. This only happens if the axis steps faster
+    // than the shaper was configured for.
+    if (s->_history_count - s->_played[s->_impulse_count - 1] == INPUT_SHAPER_HISTORY_SIZE) {
+        s->stepper->missed_deadlines++;
+        s->_error += direction < 0 ? -INPUT_SHAPER_WEIGHT_ONE : INPUT_SHAPER_WEIGHT_ONE;
+        return;
+    }
+
+    uint32_t index = s->_history_count % INPUT_SHAPER_HISTORY_SIZE;
+    s->_history_at[index] = (uint32_t)(to_us_since_boot(at));
+    if (direction < 0) {
+        s->_history_reversed[index / 32] |= 1u << (index % 32);
+    } else {
+        s->_history_reversed[index / 32] &= ~(1u << (index % 32));
+    }
+    s->_latest_at = at;
+    s->_history_count++;
+
+    // Nothing that's added later can happen before this step, so everything
+    // up until it can be played back.
+    while (play_next_impulse(s, 0)) {}
+}
+
+void __not_in_flash_func(InputShaper_drain)(struct InputShaper* s, absolute_time_t until) {
+    if (!InputShaper_is_pending(s)) {
+        return;
+    }
+
+    int64_t until_us = absolute_time_diff_us(s->_latest_at, until);
+    until_us = MIN(MAX(until_us, INT32_MIN), INT32_MAX);
+    while (play_next_impulse(s, (int32_t)(until_us))) {}
+}
+
+absolute_time_t __not_in_flash_func(InputShaper_next_step_at)(struct InputShaper* s) {
+    if (!InputShaper_is_pending(s)) {
+        return at_the_end_of_time;
+    }
+
+    // The last impulse is always the furthest behind, but the impulses before
+    // it could still have steps to play back that happen sooner.
+    int32_t next = INT32_MAX;
+    uint32_t latest = (uint32_t)(to_us_since_boot(s->_latest_at));
+    for (size_t i = 0; i < s->_impulse_count; i++) {
+        if (s->_played[i] == s->_history_count) {
+            continue;
+        }
+        uint32_t index = s->_played[i] % INPUT_SHAPER_HISTORY_SIZE;
+        int32_t at = (int32_t)(s->_history_at[index] + s->_impulse_delay_us[i] - latest);
+        next = MIN(next, at);
+    }
+
+    absolute_time_t t;
+    update_us_since_boot(&t, to_us_since_boot(s->_latest_at) + (uint64_t)(int64_t)(next));
+    return t;
+}
+
+void InputShaper_reset(struct InputShaper* s) {
+    s->_history_count = 0;
+    for (size_t i = 0; i < INPUT_SHAPER_MAX_IMPULSES; i++) { s->_played[i] = 0; }
+    s->_error = 0;
+}
+
+/*
+    Private methods
+*/
+
+// Returns how many more words fit in the steppers' streams right now.
+static inline size_t stream_room(struct InputShaper* s) {
+    size_t room = STEPPER_STREAM_BLOCK_SIZE - s->stepper->_stream_fill_count;
+    if (s->stepper2 != NULL) {
+        room = MIN(room, STEPPER_STREAM_BLOCK_SIZE - s->stepper2->_stream_fill_count);
+    }
+    return room;
+}
+
+// Plays back the earliest impulse that happens at or before the given time,
+// in microseconds relative to the most recent unshaped step. Returns false if
+// there's no such impulse, or no room in the stream for it.
+static bool __not_in_flash_func(play_next_impulse)(struct InputShaper* s, int32_t until) {
+    uint32_t latest = (uint32_t)(to_us_since_boot(s->_latest_at));
+
+    size_t next = INPUT_SHAPER_MAX_IMPULSES;
+    int32_t next_at = 0;
+    for (size_t i = 0; i < s->_impulse_count; i++) {
+        if (s->_played[i] == s->_history_count) {
+            continue;
+        }
+        uint32_t index = s->_played[i] % INPUT_SHAPER_HISTORY_SIZE;
+        int32_t at = (int32_t)(s->_history_at[index] + s->_impulse_delay_us[i] - latest);
+        if (at <= until && (next == INPUT_SHAPER_MAX_IMPULSES || at < next_at)) {
+            next = i;
+            next_at = at;
+        }
+    }
+
+    if (next == INPUT_SHAPER_MAX_IMPULSES) {
+        return false;
+    }
+
+    uint32_t index = s->_played[next] % INPUT_SHAPER_HISTORY_SIZE;
+    bool reversed = s->_history_reversed[index / 32] & (1u << (index % 32));
+    int32_t error = s->_error + (reversed ? -s->_impulse_weight[next] : s->_impulse_weight[next]);
+
+    // A single unshaped step can play back several impulses, so the stream
+    // can fill up partway. If there's no room for the steps that this impulse
+    // takes, it and the ones after it wait for the next refill.
+    size_t step_count = (size_t)((abs(error) + INPUT_SHAPER_WEIGHT_ONE / 2 - 1) / INPUT_SHAPER_WEIGHT_ONE);
+    if (step_count > stream_room(s)) {
+        return false;
+    }
+
+    s->_played[next]++;
+    s->_error = error;
+
+    absolute_time_t at;
+    update_us_since_boot(&at, to_us_since_boot(s->_latest_at) + (uint64_t)(int64_t)(next_at));
+
+    // Step whenever the shaped position is more than half a step away from
+    // the stepper's position. That's usually once at most, but steps that
+    // didn't fit in the history are caught up on here too.
+    while (s->_error > INPUT_SHAPER_WEIGHT_ONE / 2 || s->_error < -INPUT_SHAPER_WEIGHT_ONE / 2) {
+        int8_t direction = s->_error > 0 ? 1 : -1;
+        s->_error -= direction * INPUT_SHAPER_WEIGHT_ONE;
+
+        s->stepper->direction = direction;
+        Stepper_queue_step(s->stepper, at);
+        if (s->stepper2 != NULL) {
+            s->stepper2->direction = direction;
+            Stepper_queue_step(s->stepper2, at);
+        }
+    }
+    return true;
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include "pico/time.h"
+#include "stepper.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The most impulses that any of the shapers use.
+#define INPUT_SHAPER_MAX_IMPULSES 3
+// How many of the axis' unshaped steps the shaper can hold on to. This has to
+// cover every step that the axis takes within the shaper's longest impulse
+// delay, so it sets how slow a shaper can be at the axis' top step rate-
+// 2048 steps is about 21 ms at 600 mm/s and 160 steps/mm, which is enough for
+// a ZV shaper down to 24 Hz, an MZV shaper down to 36 Hz, or a ZVD shaper
+// down to 47 Hz. This must be a multiple of 32.
+#define INPUT_SHAPER_HISTORY_SIZE 2048
+// Impulse weights are fixed-point, this is a weight of one.
+#define INPUT_SHAPER_WEIGHT_ONE (1 << 16)
+
+enum InputShaperType {
+    INPUT_SHAPER_NONE = 0,
+    // Zero vibration: two impulses, half a period apart.
+    INPUT_SHAPER_ZV = 1,
+    // Zero vibration and derivative: three impulses over a whole period, it's
+    // less sensitive to the frequency being off but takes twice as long.
+    INPUT_SHAPER_ZVD = 2,
+    // Modified zero vibration: three impulses over three quarters of a
+    // period, somewhere in between ZV and ZVD.
+    INPUT_SHAPER_MZV = 3,
+};
+
+// Shapes an axis' step stream to cancel out the machine's ringing at a given
+// frequency. Each step is split into a few impulses that are spread out over
+// part of the ringing's period, and the stepper steps whenever the impulses
+// add up to half a step. The shaped steps add up to the same position as the
+// unshaped ones, they just arrive at it later and more gently.
+struct InputShaper {
+    struct Stepper* stepper;
+    struct Stepper* stepper2;
+
+    // Configuration, change using InputShaper_configure().
+    enum InputShaperType type;
+    float frequency_hz;
+    float damping_ratio;
+
+    // internal state
+
+    // When each impulse happens after the unshaped step, in microseconds, and
+    // how much of the step it carries. The weights add up to exactly one.
+    size_t _impulse_count;
+    uint32_t _impulse_delay_us[INPUT_SHAPER_MAX_IMPULSES];
+    int32_t _impulse_weight[INPUT_SHAPER_MAX_IMPULSES];
+
+    // The unshaped steps, kept in a ring buffer until every impulse has
+    // played them back. Only the lower 32 bits of the steps' times are kept,
+    // _latest_at is the full time of the most recent step.
+    uint32_t _history_at[INPUT_SHAPER_HISTORY_SIZE];
+    // One bit per step, set if the step was backwards.
+    uint32_t _history_reversed[INPUT_SHAPER_HISTORY_SIZE / 32];
+    absolute_time_t _latest_at;
+    // How many steps have been added to the history, and how many of those
+    // each impulse has played back so far.
+    uint32_t _history_count;
+    uint32_t _played[INPUT_SHAPER_MAX_IMPULSES];
+    // How far the shaped position is ahead of the stepper's position, in
+    // fractions of a step.
+    int32_t _error;
+};
+
+void InputShaper_init(struct InputShaper* s, struct Stepper* stepper, struct Stepper* stepper2);
+
+// Changes the shaper's type, frequency, and damping ratio. This can only be
+// done while the axis isn't moving. Returns false if the parameters don't make
+// sense, or if the history isn't big enough for the shaper at the given step
+// rate, in which case the shaper is left alone.
+bool InputShaper_configure(
+    struct InputShaper* s, enum InputShaperType type, float frequency_hz, float damping_ratio, float max_step_rate_hz);
+
+// Returns the fastest that the axis can step, in steps per second, without
+// overflowing the shaper's history.
+float InputShaper_max_step_rate_hz(struct InputShaper* s);
+
+static inline bool InputShaper_enabled(struct InputShaper* s) { return s->type != INPUT_SHAPER_NONE; }
+
+// Returns the shaper type's name, for reporting.
+const char* InputShaper_type_name(enum InputShaperType type);
+
+// Adds an unshaped step and queues the shaped steps that happen up until it.
+// Steps have to be added in order.
+void InputShaper_queue_step(struct InputShaper* s, int8_t direction, absolute_time_t at);
+
+// Queues the shaped steps that happen up until the given time. The caller
+// has to make sure that no unshaped steps will be added before then.
+void InputShaper_drain(struct InputShaper* s, absolute_time_t until);
+
+// Returns true if there are shaped steps that haven't been queued yet.
+static inline bool InputShaper_is_pending(struct InputShaper* s) {
+    return s->_impulse_count > 0 && s->_played[s->_impulse_count - 1] != s->_history_count;
+}
+
+// Returns when the next shaped step could happen, or at_the_end_of_time if
+// there's nothing pending.
+absolute_time_t InputShaper_next_step_at(struct InputShaper* s);
+
+// Throws away any pending steps.
+void InputShaper_reset(struct InputShaper* s);
@@ -7,6 +7,10 @@
 #include <math.h>
 #include <stdlib.h>
 
+static inline float ramp_time_s(const struct LinearAxisProfile* profile);
+static float ramp_position_at(const struct LinearAxisProfile* profile, float distance_mm);
+static float ramp_distance_mm(const struct LinearAxisProfile* profile, float velocity_mm_s);
+
 /*
     Public methods
 */
@@ -14,213 +18,727 @@
 void LinearAxis_init(struct LinearAxis* m, char name, struct Stepper* stepper) {
     m->name = name;
     m->stepper = stepper;
+    m->shaper = NULL;
 
     m->velocity_mm_s = 100.0f;
     m->acceleration_mm_s2 = 1000.0f;
+    m->jerk_mm_s3 = 0.0f;
     m->homing_sensitivity = 100;
+    m->homing_single_pass = false;
+    m->homing_squaring = false;
+    m->homing_squaring_offset_mm = 0.0f;
     m->endstop = 0;
 
+    m->_homing_state = LINEAR_AXIS_HOMING_DONE;
+    m->_stepper_halted = false;
+    m->_stepper2_halted = false;
     m->_current_move = (struct LinearAxisMovement){};
+
+    for (size_t i = 0; i < LINEAR_AXIS_PROFILE_CACHE_SIZE; i++) {
+        m->_profiles[i] = (struct LinearAxisProfile){};
+    }
+    m->_profile_uses = 0;
 }
 
-void stallguard_seek(struct LinearAxis* m, float dist_mm) {
-    Stepper_enable_stealthchop(m->stepper);
-    Stepper_disable_stallguard(m->stepper);
+// Homing seeks towards the home position until the axis stalls (or hits its
+// endstop). The stepper's position is latched by the GPIO interrupt the
+// moment that happens, so the home position is exact even though the axis
+// carries on for a little while before it's stopped. That's good enough to
+// home in a single pass, otherwise the axis bounces back a little and seeks
+// again more carefully. Each phase is a state of LinearAxis_homing_step() so
+// that several axes can home at the same time.
+//
+// Talking to the drivers over UART takes a while and would hold up the other
+// axes, so the drivers are set up for the whole of homing before it starts and
+// put back afterwards. While homing the latches are only reset, which doesn't
+// touch the drivers.
+
+static inline bool squaring(const struct LinearAxis* m) {
+    return m->homing_squaring && m->stepper2 != NULL && !m->_homing_with_endstop;
+}
 
-    LinearAxis_start_move(m, LinearAxis_calculate_move(m, dist_mm));
+// Starts a move that's stepped directly rather than through the step streams,
+// so it starts from now- or from the axis' last step, if that's later.
+static void start_direct_move(struct LinearAxis* m, const struct LinearAxisMovement* move) {
+    absolute_time_t start_at = get_absolute_time();
+    if (absolute_time_diff_us(start_at, m->_next_step_at) > 0) {
+        start_at = m->_next_step_at;
+    }
+    LinearAxis_start_move(m, move, start_at);
+}
 
-    bool check_for_stall = false;
-    while (true) {
-        LinearAxis_timed_step(m);
+static void start_seek(struct LinearAxis* m, float dist_mm) {
+    if (m->_homing_with_endstop) {
+        Stepper_reset_latch(m->stepper);
+        m->_homing_latch_armed = true;
+    } else {
+        m->_homing_latch_armed = false;
+    }
 
-        // Once the axis is up to speed, enable stallguard and watch for stalls
-        if (m->_current_move.steps_taken == m->_current_move.accel_step_count) {
-            Stepper_enable_stallguard(m->stepper, m->homing_sensitivity);
-            check_for_stall = true;
-        }
+    struct LinearAxisMovement move;
+    LinearAxis_calculate_move(m, &move, dist_mm);
+    start_direct_move(m, &move);
+}
 
-        if (check_for_stall && Stepper_stalled(m->stepper)) {
-            break;
+static bool seek_triggered(struct LinearAxis* m) {
+    // StallGuard can't tell a stall from the motor just moving slowly, so
+    // stalls only count once the axis is up to speed.
+    if (!m->_homing_latch_armed && m->_current_move.steps_taken >= m->_current_move.accel_step_count) {
+        Stepper_reset_latch(m->stepper);
+        if (squaring(m)) {
+            Stepper_reset_latch(m->stepper2);
         }
+        m->_homing_latch_armed = true;
+    }
+
+    if (!m->_homing_latch_armed) {
+        return false;
+    }
+    if (!squaring(m)) {
+        return Stepper_latched(m->stepper);
+    }
+
+    // Each motor stops as soon as it stalls, so both sides of the gantry end
+    // up against the frame and the gantry is square.
+    m->_stepper_halted = Stepper_latched(m->stepper);
+    m->_stepper2_halted = Stepper_latched(m->stepper2);
+    return m->_stepper_halted && m->_stepper2_halted;
+}
+
+// Home is where each motor was when its latch triggered, they've taken a few
+// more steps since.
+static void set_home_position(struct LinearAxis* m) {
+    m->stepper->total_steps -= Stepper_latched_steps(m->stepper);
+    if (squaring(m)) {
+        m->stepper2->total_steps -= Stepper_latched_steps(m->stepper2);
     }
+}
 
+static void finish_seek(struct LinearAxis* m) {
     LinearAxis_stop(m);
-    LinearAxis_reset_position(m);
-    Stepper_disable_stallguard(m->stepper);
-    Stepper_disable_stealthchop(m->stepper);
+    m->_stepper_halted = false;
+    m->_stepper2_halted = false;
+    m->_homing_latch_armed = false;
 }
 
-void LinearAxis_sensorless_home(struct LinearAxis* m) {
-    // TODO/Note: If an axis has two motors, this only monitors StallGuard
-    // on the first of the two motors. At some point it probably makes sense
-    // to monitor both. In practice, this hasn't caused any issues so far.
+// Moves just the second motor by the squaring offset, this makes up for the
+// two sides of the gantry not stalling at quite the same place.
+static void start_squaring_offset(struct LinearAxis* m) {
+    m->_stepper_halted = true;
 
-    //
-    // 1: Initial seek
-    //
-    report_debug_ln("homing %c axis with sensitivity at %u...", m->name, m->homing_sensitivity);
+    struct LinearAxisMovement move;
+    LinearAxis_calculate_move_from(m, &move, 0, -(m->homing_direction * m->homing_squaring_offset_mm));
+    start_direct_move(m, &move);
+    m->_homing_state = LINEAR_AXIS_HOMING_SQUARE;
+}
 
-    float old_velocity = m->velocity_mm_s;
-    float old_acceleration = m->acceleration_mm_s2;
+static void start_homing(struct LinearAxis* m) {
+    m->_homing_old_velocity_mm_s = m->velocity_mm_s;
+    m->_homing_old_acceleration_mm_s2 = m->acceleration_mm_s2;
     m->velocity_mm_s = m->homing_velocity_mm_s;
     m->acceleration_mm_s2 = m->homing_acceleration_mm_s2;
     m->stepper->total_steps = 0;
 
-    stallguard_seek(m, m->homing_direction * m->homing_distance_mm);
+    start_seek(m, m->homing_direction * m->homing_distance_mm);
+    m->_homing_state = LINEAR_AXIS_HOMING_SEEK;
+}
 
-    //
-    // 2. Bounce
-    //
-    report_debug_ln("endstop found, bouncing...");
+static void stop_homing(struct LinearAxis* m) {
+    m->velocity_mm_s = m->_homing_old_velocity_mm_s;
+    m->acceleration_mm_s2 = m->_homing_old_acceleration_mm_s2;
+    m->_homing_state = LINEAR_AXIS_HOMING_DONE;
+}
 
-    LinearAxis_start_move(m, LinearAxis_calculate_move(m, -(m->homing_direction * m->homing_bounce_mm)));
+void LinearAxis_start_sensorless_homing(struct LinearAxis* m) {
+    // Note: If an axis has two motors, this only monitors StallGuard on the
+    // first of the two motors unless homing_squaring is set.
+    report_debug_ln("homing %c axis with sensitivity at %u...", m->name, m->homing_sensitivity);
 
-    while (LinearAxis_is_moving(m)) { LinearAxis_timed_step(m); }
+    m->_homing_with_endstop = false;
 
-    //
-    // 3. Re-seek
-    //
-    report_debug_ln("re-seeking...");
+    // StallGuard only works in StealthChop. The threshold stays set for the
+    // whole of homing, stalls are ignored until the axis is up to speed.
+    Stepper_enable_stealthchop(m->stepper);
+    Stepper_enable_stallguard(m->stepper, m->homing_sensitivity);
+    Stepper_arm_latch(m->stepper, m->stepper->pin_diag);
+    if (squaring(m)) {
+        Stepper_enable_stealthchop(m->stepper2);
+        Stepper_enable_stallguard(m->stepper2, m->homing_sensitivity);
+        Stepper_arm_latch(m->stepper2, m->stepper2->pin_diag);
+    }
 
-    m->velocity_mm_s = m->homing_velocity_mm_s;
-    m->acceleration_mm_s2 = m->homing_acceleration_mm_s2;
-    stallguard_seek(m, m->homing_direction * m->homing_bounce_mm * 2);
+    start_homing(m);
+}
 
-    m->velocity_mm_s = old_velocity;
-    m->acceleration_mm_s2 = old_acceleration;
-    report_result_ln("%c axis homed", m->name);
+void LinearAxis_start_endstop_homing(struct LinearAxis* m) {
+    report_info_ln("homing %c axis using endstop %u...", m->name, m->endstop);
+
+    gpio_init(m->endstop);
+    gpio_set_dir(m->endstop, GPIO_IN);
+    gpio_pull_up(m->endstop);
+
+    m->_homing_with_endstop = true;
+    Stepper_arm_latch(m->stepper, m->endstop);
+
+    start_homing(m);
 }
 
-void endstop_seek(struct LinearAxis* m, float dist_mm) {
-    LinearAxis_start_move(m, LinearAxis_calculate_move(m, dist_mm));
+void LinearAxis_finish_homing(struct LinearAxis* m) {
+    Stepper_disarm_latch(m->stepper);
+    if (m->_homing_with_endstop) {
+        return;
+    }
+    Stepper_disable_stallguard(m->stepper);
+    Stepper_disable_stealthchop(m->stepper);
+    if (squaring(m)) {
+        Stepper_disarm_latch(m->stepper2);
+        Stepper_disable_stallguard(m->stepper2);
+        Stepper_disable_stealthchop(m->stepper2);
+    }
+}
 
-    while (gpio_get(m->endstop) != 1) { LinearAxis_timed_step(m); }
+bool LinearAxis_homing_step(struct LinearAxis* m) {
+    switch (m->_homing_state) {
+        //
+        // 1. Initial seek, and 3. Re-seek
+        //
+        case LINEAR_AXIS_HOMING_SEEK:
+        case LINEAR_AXIS_HOMING_RESEEK: {
+            LinearAxis_timed_step(m);
+
+            if (seek_triggered(m)) {
+                set_home_position(m);
+                finish_seek(m);
+
+                if (m->homing_single_pass || m->_homing_state == LINEAR_AXIS_HOMING_RESEEK) {
+                    if (squaring(m) && m->homing_squaring_offset_mm != 0.0f) {
+                        start_squaring_offset(m);
+                    } else {
+                        stop_homing(m);
+                        report_result_ln("%c axis homed", m->name);
+                    }
+                    break;
+                }
+
+                //
+                // 2. Bounce
+                //
+                report_debug_ln("%c axis home found, bouncing...", m->name);
+
+                struct LinearAxisMovement move;
+                LinearAxis_calculate_move(m, &move, -(m->homing_direction * m->homing_bounce_mm));
+                start_direct_move(m, &move);
+                m->_homing_state = LINEAR_AXIS_HOMING_BOUNCE;
+
+            } else if (!LinearAxis_is_moving(m)) {
+                // The axis went all the way without finding home.
+                finish_seek(m);
+                stop_homing(m);
+                report_error_ln("%c axis didn't find home", m->name);
+            }
+        } break;
+
+        case LINEAR_AXIS_HOMING_BOUNCE: {
+            LinearAxis_timed_step(m);
+
+            if (!LinearAxis_is_moving(m)) {
+                report_debug_ln("%c axis re-seeking...", m->name);
+
+                // Endstops are re-seeked slowly to find them more precisely.
+                if (m->_homing_with_endstop) {
+                    m->velocity_mm_s = m->homing_velocity_mm_s / 5.0f;
+                    m->acceleration_mm_s2 = m->homing_acceleration_mm_s2 / 2.0f;
+                }
+                start_seek(m, m->homing_direction * m->homing_bounce_mm * 2);
+                m->_homing_state = LINEAR_AXIS_HOMING_RESEEK;
+            }
+        } break;
+
+        case LINEAR_AXIS_HOMING_SQUARE: {
+            LinearAxis_timed_step(m);
+
+            if (!LinearAxis_is_moving(m)) {
+                m->_stepper_halted = false;
+                stop_homing(m);
+                report_result_ln("%c axis homed", m->name);
+            }
+        } break;
+
+        case LINEAR_AXIS_HOMING_DONE:
+            return false;
+    }
 
-    LinearAxis_stop(m);
-    LinearAxis_reset_position(m);
+    return true;
+}
+
+void LinearAxis_sensorless_home(struct LinearAxis* m) {
+    LinearAxis_start_sensorless_homing(m);
+    while (LinearAxis_homing_step(m)) {}
+    LinearAxis_finish_homing(m);
 }
 
 void LinearAxis_endstop_home(struct LinearAxis* m) {
-    //
-    // 1: Initial seek
-    //
-    report_info_ln("homing %c axis using endstop %u...", m->name, m->endstop);
+    LinearAxis_start_endstop_homing(m);
+    while (LinearAxis_homing_step(m)) {}
+    LinearAxis_finish_homing(m);
+}
 
-    gpio_init(m->endstop);
-    gpio_set_dir(m->endstop, GPIO_IN);
-    gpio_pull_up(m->endstop);
+// Moves the axis to the given position while watching for stalls. Returns
+// false, leaving the axis stopped wherever it was, if either motor stalled.
+static bool move_watching_for_stalls(struct LinearAxis* m, float dest_mm) {
+    struct LinearAxisMovement move;
+    LinearAxis_calculate_move(m, &move, dest_mm);
+    start_direct_move(m, &move);
 
-    float old_velocity = m->velocity_mm_s;
-    float old_acceleration = m->acceleration_mm_s2;
-    m->velocity_mm_s = m->homing_velocity_mm_s;
-    m->acceleration_mm_s2 = m->homing_acceleration_mm_s2;
-    m->stepper->total_steps = 0;
+    // StallGuard can't tell a stall from the motor just moving slowly, so the
+    // slowest parts at either end of the move aren't watched. The axis is at
+    // half speed a quarter of the way through its ramp.
+    int32_t watch_from = move.accel_step_count / 4;
+    int32_t watch_until = move.total_step_count - move.decel_step_count / 4;
 
-    endstop_seek(m, m->homing_direction * m->homing_distance_mm);
+    while (LinearAxis_is_moving(m)) {
+        LinearAxis_timed_step(m);
 
-    //
-    // 2. Bounce
-    //
-    report_info_ln("endstop found, bouncing...");
+        int32_t steps_taken = m->_current_move.steps_taken;
+        if (steps_taken < watch_from || steps_taken > watch_until) {
+            continue;
+        }
+        if (Stepper_stalled(m->stepper) || (m->stepper2 != NULL && Stepper_stalled(m->stepper2))) {
+            LinearAxis_stop(m);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+float LinearAxis_tune_acceleration(
+    struct LinearAxis* m, float distance_mm, float start_mm_s2, float end_mm_s2, float step_mm_s2, uint32_t cycles) {
+    report_info_ln(
+        "tuning %c axis acceleration from %0.0f to %0.0f mm/s^2...",
+        m->name,
+        (double)(start_mm_s2),
+        (double)(end_mm_s2));
+
+    float old_acceleration = m->acceleration_mm_s2;
+    float origin_mm = LinearAxis_get_position_mm(m);
+    float best_mm_s2 = 0.0f;
+
+    // StallGuard only works in StealthChop, which has less torque at speed
+    // than SpreadCycle, so the limit found errs on the safe side. The
+    // threshold is left on for the whole run, since changing it means talking
+    // to the driver in the middle of a move.
+    Stepper_enable_stealthchop(m->stepper);
+    Stepper_enable_stallguard(m->stepper, m->homing_sensitivity);
+    if (m->stepper2 != NULL) {
+        Stepper_enable_stealthchop(m->stepper2);
+        Stepper_enable_stallguard(m->stepper2, m->homing_sensitivity);
+    }
 
-    LinearAxis_start_move(m, LinearAxis_calculate_move(m, -(m->homing_direction * m->homing_bounce_mm)));
+    bool stalled = false;
+    uint32_t step_count = (uint32_t)(floorf((end_mm_s2 - start_mm_s2) / step_mm_s2)) + 1;
+    for (uint32_t i = 0; i < step_count && !stalled; i++) {
+        m->acceleration_mm_s2 = start_mm_s2 + step_mm_s2 * (float)(i);
 
-    while (LinearAxis_is_moving(m)) { LinearAxis_timed_step(m); }
+        for (uint32_t cycle = 0; cycle < cycles && !stalled; cycle++) {
+            stalled = !move_watching_for_stalls(m, origin_mm + distance_mm) || !move_watching_for_stalls(m, origin_mm);
+        }
 
-    //
-    // 3. Re-seek
-    //
-    report_info_ln("re-seeking...");
+        if (stalled) {
+            report_info_ln("stalled at %0.0f mm/s^2", (double)(m->acceleration_mm_s2));
+        } else {
+            best_mm_s2 = m->acceleration_mm_s2;
+            report_debug_ln("no stalls at %0.0f mm/s^2", (double)(best_mm_s2));
+        }
+    }
 
-    m->velocity_mm_s = m->homing_velocity_mm_s / 5.0f;
-    m->acceleration_mm_s2 = m->homing_acceleration_mm_s2 / 2.0f;
-    endstop_seek(m, m->homing_direction * m->homing_bounce_mm * 2);
+    Stepper_disable_stallguard(m->stepper);
+    Stepper_disable_stealthchop(m->stepper);
+    if (m->stepper2 != NULL) {
+        Stepper_disable_stallguard(m->stepper2);
+        Stepper_disable_stealthchop(m->stepper2);
+    }
 
-    m->velocity_mm_s = old_velocity;
     m->acceleration_mm_s2 = old_acceleration;
-    report_result_ln("%c axis homed", m->name);
+
+    if (stalled) {
+        // The motor skipped steps, so the axis isn't where it thinks it is.
+        report_info_ln("%c axis needs to be homed again", m->name);
+    }
+
+    return best_mm_s2;
 }
 
-struct LinearAxisMovement LinearAxis_calculate_move(struct LinearAxis* m, float dest_mm) {
+void LinearAxis_calculate_move(struct LinearAxis* m, struct LinearAxisMovement* move, float dest_mm) {
+    LinearAxis_calculate_move_from(m, move, m->stepper->total_steps, dest_mm);
+}
+
+void LinearAxis_calculate_move_from(
+    struct LinearAxis* m, struct LinearAxisMovement* move, int32_t start_steps, float dest_mm) {
     // Calculate how far to move to bring the motor to the destination.
     // Do the calculation based on steps (integers) instead of mm (floats) to
     // ensure consistency.
     int32_t dest_steps = (int32_t)(lroundf(ceilf(dest_mm * m->steps_per_mm)));
-    int32_t delta_steps = dest_steps - m->stepper->total_steps;
+    int32_t delta_steps = dest_steps - start_steps;
     int32_t dir = delta_steps < 0 ? -1 : 1;
 
     // Determine the number of steps needed to complete the move.
     int32_t total_step_count = abs(delta_steps);
 
-    // Determine how long acceleration and deceleration will take and
-    // how many steps will be spent in each of the three phases (accelerating,
-    // coasting, decelerating).
-    float accel_time_s = m->velocity_mm_s / m->acceleration_mm_s2;
-    float accel_distance_mm = 0.5f * accel_time_s * m->velocity_mm_s;
-    int32_t accel_step_count = (int32_t)(lroundf(accel_distance_mm * m->steps_per_mm));
-    int32_t decel_step_count = accel_step_count;
-    int32_t coast_step_count = total_step_count - accel_step_count - decel_step_count;
+    *move = (struct LinearAxisMovement){
+        .direction = dir,
+        .profile = LinearAxis_get_profile(m, m->velocity_mm_s, m->acceleration_mm_s2, m->jerk_mm_s3),
+        .total_step_count = total_step_count,
+        .steps_taken = 0,
+    };
+
+    LinearAxisMovement_set_profile(move, 0, 0);
+
+    // Calculate the *actual* distance that the motor will move based on the
+    // stepping resolution.
+    float actual_delta_mm = dir * (float)(total_step_count) * (1.0f / m->steps_per_mm);
+    report_info_ln(
+        "Calculated %c axis move: %0.3f mm (%li steps), accel: %li steps, coast: %li steps, decel: %li steps.",
+        m->name,
+        (double)actual_delta_mm,
+        dir * total_step_count,
+        move->accel_step_count,
+        move->coast_step_count,
+        move->decel_step_count);
+}
+
+static void calculate_profile(
+    struct LinearAxis* m,
+    struct LinearAxisProfile* profile,
+    float velocity_mm_s,
+    float acceleration_mm_s2,
+    float jerk_mm_s3) {
+    *profile = (struct LinearAxisProfile){
+        .steps_per_mm = m->steps_per_mm,
+        .velocity_mm_s = velocity_mm_s,
+        .acceleration_mm_s2 = acceleration_mm_s2,
+        .jerk_mm_s3 = jerk_mm_s3,
+        .s_curve = jerk_mm_s3 > 0.0f,
+    };
+
+    // The profile is calculated in terms of a "ramp": how many steps it takes
+    // to accelerate from a standstill to the axis' velocity. Moves that are
+    // entered or exited at some velocity (or that are too short to reach full
+    // velocity) only use part of the ramp.
+    float ramp_mm = ramp_distance_mm(profile, profile->velocity_mm_s);
+    profile->ramp_step_count = MAX(1, (int32_t)(lroundf(ramp_mm * m->steps_per_mm)));
+
+    // Pre-calculate everything that the step interval generator needs, so
+    // that it can work out each step's interval using only integer math.
+    float coast_step_interval_us = 1000000.0f / (profile->velocity_mm_s * m->steps_per_mm);
+    profile->coast_step_interval = (uint64_t)(llroundf(coast_step_interval_us * LINEAR_AXIS_INTERVAL_ONE));
+
+    // Note: these are rounded as 64-bit integers since long is only 32 bits
+    // on the RP2040, and the clamps keep them in range of their 32-bit
+    // fields: the ramp rate is at most 2^31 and the first step interval is
+    // less than 2^32.
+    float ramp_time_us = MAX(ramp_time_s(profile) * 1000000.0f, LINEAR_AXIS_MIN_RAMP_TIME_US);
+    profile->ramp_rate = (uint32_t)(llroundf(ldexpf(1.0f, 38) / ramp_time_us));
+
+    float first_step_time_us = ramp_position_at(profile, 1.0f / m->steps_per_mm) * ramp_time_us;
+    first_step_time_us = MIN(first_step_time_us, LINEAR_AXIS_MAX_FIRST_STEP_US);
+    profile->first_step_interval = (uint32_t)(llroundf(first_step_time_us * LINEAR_AXIS_INTERVAL_ONE));
+}
+
+const struct LinearAxisProfile* LinearAxis_get_profile(
+    struct LinearAxis* m, float velocity_mm_s, float acceleration_mm_s2, float jerk_mm_s3) {
+    m->_profile_uses++;
+
+    struct LinearAxisProfile* oldest = &(m->_profiles[0]);
+    for (size_t i = 0; i < LINEAR_AXIS_PROFILE_CACHE_SIZE; i++) {
+        struct LinearAxisProfile* profile = &(m->_profiles[i]);
+        if (profile->steps_per_mm == m->steps_per_mm && profile->velocity_mm_s == velocity_mm_s &&
+            profile->acceleration_mm_s2 == acceleration_mm_s2 && profile->jerk_mm_s3 == jerk_mm_s3) {
+            profile->_last_used = m->_profile_uses;
+            return profile;
+        }
+        if (m->_profile_uses - profile->_last_used > m->_profile_uses - oldest->_last_used) {
+            oldest = profile;
+        }
+    }
+
+    // Note: this is safe to do while moves are running. The moves in the
+    // queue (and the one that's executing) were all planned more recently
+    // than the least recently used profile, since the cache is larger than
+    // the number of profiles that the queued moves could have used.
+    calculate_profile(m, oldest, velocity_mm_s, acceleration_mm_s2, jerk_mm_s3);
+    oldest->_last_used = m->_profile_uses;
+    return oldest;
+}
+
+void LinearAxis_calculate_move_profile(
+    struct LinearAxis* m, struct LinearAxisMovement* move, float entry_velocity_mm_s, float exit_velocity_mm_s) {
+    LinearAxisMovement_set_profile(
+        move,
+        LinearAxis_calculate_ramp_steps(m, move, entry_velocity_mm_s),
+        LinearAxis_calculate_ramp_steps(m, move, exit_velocity_mm_s));
+}
+
+void LinearAxis_set_move_kinematics(
+    struct LinearAxis* m,
+    struct LinearAxisMovement* move,
+    float velocity_mm_s,
+    float acceleration_mm_s2,
+    float jerk_mm_s3) {
+    move->profile = LinearAxis_get_profile(m, velocity_mm_s, acceleration_mm_s2, jerk_mm_s3);
+    LinearAxisMovement_set_profile(move, 0, 0);
+}
+
+void __not_in_flash_func(LinearAxisMovement_set_profile)(
+    struct LinearAxisMovement* move, int32_t entry_step_offset, int32_t exit_step_offset) {
+    // A move that's entered at some velocity can be thought of as starting
+    // partway up the ramp, and likewise a move that's exited at some velocity
+    // stops decelerating partway down the ramp.
+    entry_step_offset = MIN(entry_step_offset, move->profile->ramp_step_count);
+    exit_step_offset = MIN(exit_step_offset, move->profile->ramp_step_count);
+
+    // Determine how many steps will be spent in each of the three phases
+    // (accelerating, coasting, decelerating).
+    int32_t accel_step_count = move->profile->ramp_step_count - entry_step_offset;
+    int32_t decel_step_count = move->profile->ramp_step_count - exit_step_offset;
+    int32_t coast_step_count = move->total_step_count - accel_step_count - decel_step_count;
 
     // Check for the case where a move is too short to reach full velocity
     // and therefore has no coasting phase. In this case, the acceleration
-    // and deceleration phases will each occupy one half of the total steps.
+    // and deceleration phases meet at whatever velocity the move can reach.
+    // For a move that starts and ends at a standstill they each occupy one
+    // half of the total steps.
     if (coast_step_count <= 0) {
-        accel_step_count = total_step_count / 2;
+        accel_step_count = (move->total_step_count + exit_step_offset - entry_step_offset) / 2;
+        accel_step_count = MAX(0, MIN(accel_step_count, move->total_step_count));
         // Note: use subtraction here instead of just setting it the same
         // as the acceleration step count. This accommodates odd amounts of
         // total steps and ensures that the correct amount of total steps
         // are taken. For example, if there are 11 total steps then
         // accel_step_count = 5 and decel_step_count = 6.
-        decel_step_count = total_step_count - accel_step_count;
+        decel_step_count = move->total_step_count - accel_step_count;
         coast_step_count = 0;
     }
 
-    struct LinearAxisMovement movement = {
-        .direction = dir,
-        .accel_step_count = accel_step_count,
-        .decel_step_count = decel_step_count,
-        .coast_step_count = coast_step_count,
-        .total_step_count = total_step_count,
-        .steps_taken = 0,
+    move->accel_step_count = accel_step_count;
+    move->decel_step_count = decel_step_count;
+    move->coast_step_count = coast_step_count;
+    move->entry_step_offset = entry_step_offset;
+}
+
+int32_t LinearAxis_calculate_ramp_steps(
+    struct LinearAxis* m, const struct LinearAxisMovement* move, float velocity_mm_s) {
+    return (int32_t)(lroundf(ramp_distance_mm(move->profile, velocity_mm_s) * m->steps_per_mm));
+}
+
+// The ramp is described in terms of how far through it the axis is in time,
+// τ = t / T, where T is the ramp's duration. With constant acceleration the
+// velocity is linear in τ:
+//
+//   v(τ) = V × τ
+//   d(τ) = V × T × τ² / 2
+//
+// The S-curve profile instead follows a smoothstep polynomial:
+//
+//   v(τ) = V × (3τ² - 2τ³)
+//   d(τ) = V × T × (τ³ - τ⁴ / 2)
+//
+// Acceleration peaks at 1.5 × V / T halfway up the ramp and jerk peaks at
+// 6 × V / T² at either end, so T is the shortest duration that keeps both
+// within their limits. Either way, the whole ramp covers V × T / 2.
+static inline float ramp_time_s(const struct LinearAxisProfile* profile) {
+    if (!(profile->jerk_mm_s3 > 0.0f)) {
+        return profile->velocity_mm_s / profile->acceleration_mm_s2;
+    }
+    return MAX(
+        1.5f * profile->velocity_mm_s / profile->acceleration_mm_s2,
+        sqrtf(6.0f * profile->velocity_mm_s / profile->jerk_mm_s3));
+}
+
+// Returns τ at the given distance along the ramp.
+static float ramp_position_at(const struct LinearAxisProfile* profile, float distance_mm) {
+    float x = distance_mm / (profile->velocity_mm_s * ramp_time_s(profile));
+    if (x <= 0.0f) {
+        return 0.0f;
+    }
+    if (x >= 0.5f) {
+        return 1.0f;
+    }
+    if (!(profile->jerk_mm_s3 > 0.0f)) {
+        return sqrtf(2.0f * x);
+    }
+
+    // Solve τ³ - τ⁴ / 2 = x for τ. The cube root is a close starting point
+    // for small distances, and a few Newton iterations are plenty from there.
+    float tau = cbrtf(x);
+    for (size_t i = 0; i < 5; i++) {
+        float tau2 = tau * tau;
+        float f = tau2 * tau - 0.5f * tau2 * tau2 - x;
+        float df = 3.0f * tau2 - 2.0f * tau2 * tau;
+        tau = MIN(tau - f / df, 1.0f);
+    }
+    return tau;
+}
+
+static float ramp_distance_mm(const struct LinearAxisProfile* profile, float velocity_mm_s) {
+    if (!(profile->jerk_mm_s3 > 0.0f)) {
+        // Determine how long it takes to accelerate to the given velocity and
+        // how far the axis travels while doing so.
+        float accel_time_s = velocity_mm_s / profile->acceleration_mm_s2;
+        return 0.5f * accel_time_s * velocity_mm_s;
+    }
+
+    // Invert the smoothstep to find how far along the ramp the given velocity
+    // is reached.
+    float u = MAX(0.0f, MIN(velocity_mm_s / profile->velocity_mm_s, 1.0f));
+    float tau = 0.5f - sinf(asinf(1.0f - 2.0f * u) / 3.0f);
+    return profile->velocity_mm_s * ramp_time_s(profile) * (tau * tau * tau - 0.5f * tau * tau * tau * tau);
+}
+
+float LinearAxisMovement_ramp_distance_mm(const struct LinearAxisMovement* move, float velocity_mm_s) {
+    return ramp_distance_mm(move->profile, velocity_mm_s);
+}
+
+float LinearAxisMovement_ramp_velocity_mm_s(const struct LinearAxisMovement* move, float distance_mm) {
+    const struct LinearAxisProfile* profile = move->profile;
+    float tau = ramp_position_at(profile, distance_mm);
+    if (!(profile->jerk_mm_s3 > 0.0f)) {
+        return profile->velocity_mm_s * tau;
+    }
+    return profile->velocity_mm_s * tau * tau * (3.0f - 2.0f * tau);
+}
+
+// Reciprocals of 1 + i / 256 for i = 0 to 256, scaled by 2^31. Dividing by
+// the fraction of the velocity is the costliest part of working out a step's
+// interval (there's no divide instruction and the hardware divider is only
+// 32-bit), so the interval generator multiplies by a reciprocal from this
+// table instead. Linearly interpolating between entries keeps the relative
+// error under 4 parts per million. This lives in RAM since it's used for
+// every step.
+#define RECIPROCAL(i) (uint32_t)(((1ull << 46) + (32768u + (i) * 128u) / 2) / (32768u + (i) * 128u))
+#define RECIPROCALS_4(i) RECIPROCAL(i), RECIPROCAL(i + 1), RECIPROCAL(i + 2), RECIPROCAL(i + 3)
+#define RECIPROCALS_16(i) RECIPROCALS_4(i), RECIPROCALS_4(i + 4), RECIPROCALS_4(i + 8), RECIPROCALS_4(i + 12)
+#define RECIPROCALS_64(i) RECIPROCALS_16(i), RECIPROCALS_16(i + 16), RECIPROCALS_16(i + 32), RECIPROCALS_16(i + 48)
+
+static const uint32_t __not_in_flash("linear_axis") reciprocals[257] = {
+    RECIPROCALS_64(0), RECIPROCALS_64(64), RECIPROCALS_64(128), RECIPROCALS_64(192), RECIPROCAL(256)};
+
+float LinearAxis_move_time_s(float distance_mm, float velocity_mm_s, float acceleration_mm_s2, float jerk_mm_s3) {
+    struct LinearAxisProfile profile = {
+        .velocity_mm_s = velocity_mm_s,
+        .acceleration_mm_s2 = acceleration_mm_s2,
+        .jerk_mm_s3 = jerk_mm_s3,
     };
+    float ramp_s = ramp_time_s(&profile);
+    float ramp_mm = 0.5f * velocity_mm_s * ramp_s;
 
-    // Generate the acceleration look-up table.
-    for (size_t i = 0; i < LINEAR_AXIS_LUT_COUNT; i++) {
-        int32_t steps = (float)(i) / (float)(LINEAR_AXIS_LUT_COUNT - 1) * (float)(accel_step_count);
-        uint16_t step_time = (uint16_t)(LinearAxisMovement_calculate_lut_entry(m, steps));
-        movement.lut[i] = step_time;
+    if (distance_mm >= 2.0f * ramp_mm) {
+        return 2.0f * ramp_s + (distance_mm - 2.0f * ramp_mm) / velocity_mm_s;
     }
 
-    report_info_ln(
-        "Calculated move: accel: %li steps, coast: %li steps, decel: %li steps.",
-        movement.accel_step_count,
-        movement.coast_step_count,
-        movement.decel_step_count);
+    // The move turns around partway up the ramp.
+    return 2.0f * ramp_s * ramp_position_at(&profile, 0.5f * distance_mm);
+}
 
-    return movement;
+float LinearAxis_velocity_for_move_time(
+    float distance_mm, float move_time_s, float velocity_mm_s, float acceleration_mm_s2, float jerk_mm_s3) {
+    if (LinearAxis_move_time_s(distance_mm, velocity_mm_s, acceleration_mm_s2, jerk_mm_s3) >= move_time_s) {
+        return velocity_mm_s;
+    }
+
+    // Moves only get quicker as the velocity goes up, so the velocity can be
+    // found by bisection.
+    float low = 0.0f;
+    float high = velocity_mm_s;
+    for (size_t i = 0; i < 24; i++) {
+        float mid = 0.5f * (low + high);
+        if (LinearAxis_move_time_s(distance_mm, mid, acceleration_mm_s2, jerk_mm_s3) > move_time_s) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+    return high;
 }
 
-void LinearAxis_start_move(struct LinearAxis* m, struct LinearAxisMovement move) {
-    m->stepper->direction = move.direction;
-    Stepper_update_direction(m->stepper);
+// Returns the interval between steps while moving at the velocity at the given
+// point along the ramp.
+static inline int64_t __not_in_flash_func(interval_at)(const struct LinearAxisProfile* profile, uint32_t position) {
+    // The fraction of the move's velocity at this point, as a 0.16 fixed-point
+    // number.
+    uint32_t tau = position >> (LINEAR_AXIS_RAMP_FRACTION_BITS - 16);
+    uint32_t fraction = tau;
+    if (profile->s_curve) {
+        uint32_t tau2 = (uint32_t)(((uint64_t)(tau) * tau) >> 16);
+        fraction = (uint32_t)(((uint64_t)(tau2) * ((3u << 16) - 2u * tau)) >> 16);
+    }
+    if (fraction >= (1u << 16)) {
+        return (int64_t)(profile->coast_step_interval);
+    }
 
-    if (m->stepper2 != NULL) {
-        m->stepper2->direction = move.direction;
-        Stepper_update_direction(m->stepper2);
+    // Normalize the fraction into [1, 2) as a 1.15 fixed-point number, the
+    // top 8 bits after the leading one index the table and the rest blend
+    // between neighboring entries.
+    uint32_t shift = (uint32_t)(__builtin_clz(MAX(fraction, 1u))) - 16;
+    uint32_t normalized = fraction << shift;
+    uint32_t index = (normalized >> 7) & 0xFF;
+    uint32_t blend = normalized & 0x7F;
+    uint32_t reciprocal = reciprocals[index] - (((reciprocals[index] - reciprocals[index + 1]) * blend) >> 7);
+
+    // coast_step_interval / fraction = coast_step_interval × reciprocal × 2^shift / 2^30
+    return (int64_t)((((uint64_t)(profile->coast_step_interval)) * reciprocal) >> (30 - shift));
+}
+
+// Returns how far through the ramp the given amount of time is.
+static inline uint64_t __not_in_flash_func(ramp_delta)(const struct LinearAxisProfile* profile, int64_t interval) {
+    return ((uint64_t)(interval) * profile->ramp_rate) >> 24;
+}
+
+// Returns the point along the ramp that the axis will be at after the given
+// time, or before it if decelerating.
+static inline uint32_t __not_in_flash_func(ramp_position_after)(struct LinearAxis* m, bool up, int64_t interval) {
+    uint64_t delta = ramp_delta(m->_current_move.profile, interval);
+    if (up) {
+        return (uint32_t)(MIN(m->_ramp_position + delta, LINEAR_AXIS_RAMP_ONE));
     }
+    return m->_ramp_position > delta ? m->_ramp_position - (uint32_t)(delta) : 0;
+}
 
-    m->_current_move = move;
-    m->_step_interval = 100;
-    m->_next_step_at = make_timeout_time_us(m->_step_interval);
+static inline absolute_time_t __not_in_flash_func(advance_step_time)(struct LinearAxis* m, absolute_time_t from) {
+    // Only whole microseconds are added to the step time, the leftover
+    // fraction is carried over to the next step.
+    uint64_t interval = (uint64_t)(m->_step_interval) + m->_step_remainder;
+    m->_step_remainder = (uint32_t)(interval & ((1u << LINEAR_AXIS_INTERVAL_FRACTION_BITS) - 1));
+    return delayed_by_us(from, interval >> LINEAR_AXIS_INTERVAL_FRACTION_BITS);
+}
 
-    // Calculate the *actual* distance that the motor will move based on the
-    // stepping resolution.
-    float actual_delta_mm = move.direction * (float)(move.total_step_count) * (1.0f / m->steps_per_mm);
-    report_info_ln(
-        "moving %c axis %0.3f mm (%li steps)",
-        m->name,
-        (double)actual_delta_mm,
-        move.direction * move.total_step_count);
+void __not_in_flash_func(LinearAxis_start_move)(
+    struct LinearAxis* m, const struct LinearAxisMovement* move, absolute_time_t start_at) {
+    // Note: the direction pins are updated along with the first step.
+    m->stepper->direction = move->direction;
+    if (m->stepper2 != NULL) {
+        m->stepper2->direction = move->direction;
+    }
+
+    m->_current_move = *move;
+
+    if (move->entry_step_offset > 0) {
+        // This move continues on from the previous one without stopping, so
+        // the first step is scheduled relative to the last step of the
+        // previous move.
+        float tau = ramp_position_at(move->profile, (float)(move->entry_step_offset) / m->steps_per_mm);
+        m->_ramp_position = (uint32_t)(tau * LINEAR_AXIS_RAMP_ONE);
+        m->_step_interval = interval_at(move->profile, m->_ramp_position);
+        LinearAxis_lookup_step_interval(m);
+        m->_next_step_at = advance_step_time(m, m->_next_step_at);
+    } else {
+        // Starting from a standstill, the first step happens a little while
+        // after the given start time.
+        m->_step_interval = 100 << LINEAR_AXIS_INTERVAL_FRACTION_BITS;
+        m->_step_remainder = 0;
+        m->_ramp_position = 0;
+        m->_next_step_at = advance_step_time(m, start_at);
+    }
 }
 
 void LinearAxis_wait_for_move(struct LinearAxis* m) {
@@ -257,89 +775,149 @@ void LinearAxis_set_position_mm(struct LinearAxis* m, float mm) {
     Private methods
 */
 
+static inline void __not_in_flash_func(finish_step)(struct LinearAxis* m) {
+    m->_current_move.steps_taken++;
+
+    // Is the move finished?
+    if (m->_current_move.steps_taken == m->_current_move.total_step_count) {
+        m->_current_move = (struct LinearAxisMovement){};
+    }
+}
+
 void __not_in_flash_func(LinearAxis_direct_step)(struct LinearAxis* m) {
     // Are there any steps to perform?
     if (m->_current_move.total_step_count == 0) {
         return;
     }
 
-    if (m->stepper2 != NULL) {
+    if (m->stepper2 == NULL) {
+        Stepper_step(m->stepper);
+    } else if (!m->_stepper_halted && !m->_stepper2_halted) {
         Stepper_step_two(m->stepper, m->stepper2);
-    } else {
+    } else if (!m->_stepper_halted) {
         Stepper_step(m->stepper);
+    } else if (!m->_stepper2_halted) {
+        Stepper_step(m->stepper2);
     }
 
-    m->_current_move.steps_taken++;
+    finish_step(m);
+}
 
-    // Is the move finished?
-    if (m->_current_move.steps_taken == m->_current_move.total_step_count) {
-        m->_current_move = (struct LinearAxisMovement){};
+void __not_in_flash_func(LinearAxis_queue_direct_step)(struct LinearAxis* m, absolute_time_t at) {
+    if (m->_current_move.total_step_count == 0) {
+        return;
     }
+
+    if (m->shaper != NULL && InputShaper_enabled(m->shaper)) {
+        InputShaper_queue_step(m->shaper, m->_current_move.direction, at);
+    } else {
+        Stepper_queue_step(m->stepper, at);
+        if (m->stepper2 != NULL) {
+            Stepper_queue_step(m->stepper2, at);
+        }
+    }
+
+    m->_next_step_at = at;
+
+    finish_step(m);
 }
 
 bool __not_in_flash_func(LinearAxis_timed_step)(struct LinearAxis* m) {
     // Is it time to step yet?
-    if (absolute_time_diff_us(get_absolute_time(), m->_next_step_at) > 0) {
+    absolute_time_t now = get_absolute_time();
+    int64_t late_us = absolute_time_diff_us(m->_next_step_at, now);
+    if (late_us < 0) {
         return false;
     }
 
+    // Steps are scheduled relative to when the previous step was supposed to
+    // happen rather than when it actually happened, so that lateness doesn't
+    // add up over the move. Steps that are a little late are caught up on by
+    // the following steps, but if the axis has fallen too far behind then
+    // catching up would need a burst of steps faster than the motor can
+    // follow, so the schedule picks up from now instead.
+    absolute_time_t step_at = m->_next_step_at;
+    if (late_us > (m->_step_interval >> LINEAR_AXIS_INTERVAL_FRACTION_BITS)) {
+        m->stepper->missed_deadlines++;
+    }
+    if (late_us > STEP_MAX_CATCH_UP_US) {
+        step_at = now;
+    }
+
     LinearAxis_direct_step(m);
+
+    if (!LinearAxis_is_moving(m)) {
+        // Keep track of when the last step happened, in case the next move
+        // continues on from this one.
+        m->_next_step_at = step_at;
+        return true;
+    }
+
     LinearAxis_lookup_step_interval(m);
-    m->_next_step_at = make_timeout_time_us(m->_step_interval);
+    m->_next_step_at = advance_step_time(m, step_at);
 
     return true;
 }
 
-__attribute__((optimize(3))) void __not_in_flash_func(LinearAxis_lookup_step_interval)(struct LinearAxis* m) {
-    size_t lut_index;
-
-    // Acceleration phase
-    if (m->_current_move.steps_taken <= m->_current_move.accel_step_count) {
-        lut_index = m->_current_move.steps_taken * (LINEAR_AXIS_LUT_COUNT - 1) / m->_current_move.accel_step_count;
-    }
-    // Coast phase
-    else if (m->_current_move.steps_taken <= m->_current_move.accel_step_count + m->_current_move.coast_step_count) {
-        lut_index = (LINEAR_AXIS_LUT_COUNT - 1);
+bool __not_in_flash_func(LinearAxis_queue_step)(struct LinearAxis* m, absolute_time_t horizon) {
+    // Has the axis already queued everything up to the horizon?
+    if (absolute_time_diff_us(horizon, m->_next_step_at) > 0) {
+        return false;
     }
-    // Deceleration phase
-    else {
-        int32_t steps =
-            m->_current_move.steps_taken - (m->_current_move.accel_step_count + m->_current_move.coast_step_count);
-        lut_index =
-            (LINEAR_AXIS_LUT_COUNT - 1) - (steps * (LINEAR_AXIS_LUT_COUNT - 1) / m->_current_move.accel_step_count);
+
+    absolute_time_t step_at = m->_next_step_at;
+    LinearAxis_queue_direct_step(m, step_at);
+
+    if (!LinearAxis_is_moving(m)) {
+        return true;
     }
 
-    int64_t step_time_us = m->_current_move.lut[MIN(lut_index, LINEAR_AXIS_LUT_COUNT - 1)];
-    step_time_us = MIN(step_time_us, 5000);
+    // The next step is scheduled relative to this step's time instead of
+    // the current time, the stream is well ahead of the current time.
+    LinearAxis_lookup_step_interval(m);
+    m->_next_step_at = advance_step_time(m, step_at);
 
-    m->_step_interval = step_time_us;
+    return true;
 }
 
-__attribute__((optimize(3))) uint32_t
-__not_in_flash_func(LinearAxisMovement_calculate_lut_entry)(struct LinearAxis* a, uint32_t steps) {
-    // Calculate instantenous velocity at the current distance traveled.
-
-    // At 0 steps velocity is technically zero, so just cheat and pretend we're
-    // 1 step in.
-    if (steps == 0) {
-        steps = 1;
+__attribute__((optimize(3))) void __not_in_flash_func(LinearAxis_lookup_step_interval)(struct LinearAxis* m) {
+    struct LinearAxisMovement* move = &(m->_current_move);
+    const struct LinearAxisProfile* profile = move->profile;
+
+    // Coast phase. Moves slower than the longest ramp interval (like a
+    // rotation slowed down to finish along with a long linear move) coast the
+    // whole way, since ramping would only make their steps shorter.
+    int64_t max_interval = (int64_t)(LINEAR_AXIS_MAX_STEP_INTERVAL_US) << LINEAR_AXIS_INTERVAL_FRACTION_BITS;
+    if ((int64_t)(profile->coast_step_interval) >= max_interval ||
+        (move->steps_taken > move->accel_step_count &&
+         move->steps_taken <= move->accel_step_count + move->coast_step_count)) {
+        m->_ramp_position = LINEAR_AXIS_RAMP_ONE;
+        m->_step_interval = (int64_t)(profile->coast_step_interval);
+        return;
     }
 
-    // distance mm = steps * 1 / steps/mm
-    float distance = steps / a->steps_per_mm;
-    float inst_velocity = sqrtf(2.0f * distance * a->acceleration_mm_s2);
+    // Acceleration and deceleration phases move up and down the ramp. Moves
+    // that don't reach full velocity just turn around partway up the ramp.
+    bool accelerating = move->steps_taken <= move->accel_step_count;
+
+    uint64_t first_step_delta = ramp_delta(profile, profile->first_step_interval);
 
-    // Calculate the timer period from the velocity
-    float s_per_step;
-    if (inst_velocity > 0.0f) {
-        float steps_per_s = inst_velocity / (1.0f / a->steps_per_mm);
-        s_per_step = 1.0f / steps_per_s;
+    int64_t interval;
+    if (accelerating ? m->_ramp_position == 0 : m->_ramp_position <= first_step_delta) {
+        // The step to or from a standstill is pre-calculated.
+        interval = profile->first_step_interval;
     } else {
-        s_per_step = 0.005f;
+        // A step takes as long as it takes to cover one step at the velocity
+        // halfway through it, which is exact when the velocity changes
+        // linearly. Since that depends on how long the step takes, start with
+        // an estimate of the step taking as long as the previous one and
+        // refine it once.
+        interval = interval_at(profile, ramp_position_after(m, accelerating, m->_step_interval / 2));
+        interval = interval_at(profile, ramp_position_after(m, accelerating, interval / 2));
     }
 
-    uint64_t step_time_us = (uint64_t)(s_per_step * 1000000.0f);
-    step_time_us = MIN(step_time_us, 5000);
-
-    return (uint32_t)(step_time_us);
+    // Note: the ramp follows the actual interval even if the step happens
+    // sooner, otherwise the axis would get ahead of the ramp.
+    m->_ramp_position = ramp_position_after(m, accelerating, interval);
+    m->_step_interval = MIN(interval, max_interval);
 }
@@ -1,16 +1,75 @@
 #pragma once
 
+#include "input_shaper.h"
 #include "pico/time.h"
 #include "stepper.h"
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
-#define LINEAR_AXIS_LUT_COUNT 512
+// Step intervals are fixed-point microseconds so that the average step rate
+// matches the commanded velocity instead of being rounded to the nearest
+// whole microsecond.
+#define LINEAR_AXIS_INTERVAL_FRACTION_BITS 16
+#define LINEAR_AXIS_INTERVAL_ONE (1 << LINEAR_AXIS_INTERVAL_FRACTION_BITS)
+// How far through the acceleration ramp an axis is, in time, is a fixed-point
+// fraction where LINEAR_AXIS_RAMP_ONE is the end of the ramp.
+#define LINEAR_AXIS_RAMP_FRACTION_BITS 30
+#define LINEAR_AXIS_RAMP_ONE (1u << LINEAR_AXIS_RAMP_FRACTION_BITS)
+// The longest time between steps while ramping, this keeps the very start of
+// the ramp from taking forever.
+#define LINEAR_AXIS_MAX_STEP_INTERVAL_US 5000
+// The shortest acceleration ramp, in microseconds, and the longest first step
+// from a standstill. These keep the profile's fixed-point values in range.
+#define LINEAR_AXIS_MIN_RAMP_TIME_US 128.0f
+#define LINEAR_AXIS_MAX_FIRST_STEP_US 60000.0f
+// How many acceleration profiles each axis keeps around. A profile can't be
+// replaced while a queued move still refers to it, so this has to be larger
+// than the number of profiles that the machine's queued moves could use.
+#define LINEAR_AXIS_PROFILE_CACHE_SIZE 18
+
+// The parts of a move's acceleration profile that only depend on the axis'
+// kinematics. These are somewhat costly to calculate and rarely change, so
+// each axis keeps a small cache of them that movements refer to.
+struct LinearAxisProfile {
+    // The kinematics that the profile was calculated for.
+    float steps_per_mm;
+    float velocity_mm_s;
+    float acceleration_mm_s2;
+    float jerk_mm_s3;
+    // Number of steps it takes to accelerate from a standstill to the maximum
+    // velocity.
+    int32_t ramp_step_count;
+    // Pre-calculated values for generating the step intervals, see
+    // LinearAxis_lookup_step_interval().
+    // Time between steps while coasting at the maximum velocity. This is
+    // 64-bit since very slow moves can take more than 65 ms per step.
+    uint64_t coast_step_interval;
+    // Time it takes to take the first step from a standstill.
+    uint32_t first_step_interval;
+    // How far through the ramp each step interval moves, scaled by 2^24.
+    uint32_t ramp_rate;
+    // Whether to follow the jerk-limited S-curve instead of the trapezoid.
+    bool s_curve;
+    // When the profile was last used to plan a move, the least recently used
+    // profile is replaced when the cache is full.
+    uint32_t _last_used;
+};
+
+enum LinearAxisHomingState {
+    LINEAR_AXIS_HOMING_DONE = 0,
+    LINEAR_AXIS_HOMING_SEEK,
+    LINEAR_AXIS_HOMING_BOUNCE,
+    LINEAR_AXIS_HOMING_RESEEK,
+    LINEAR_AXIS_HOMING_SQUARE,
+};
 
 struct LinearAxisMovement {
     // Direction of travel, +1 or -1.
     int8_t direction;
+    // The acceleration profile for this move, this points into the axis'
+    // profile cache.
+    const struct LinearAxisProfile* profile;
     // Total number of steps to spend accelerating.
     int32_t accel_step_count;
     // Total number of steps to spend decelerating.
@@ -21,22 +80,30 @@ struct LinearAxisMovement {
     int32_t total_step_count;
     // Number of steps taken so far.
     int32_t steps_taken;
-    // acceleration look-up table
-    uint16_t lut[LINEAR_AXIS_LUT_COUNT];
+    // How far along the ramp the move starts, this is non-zero for moves that
+    // are entered at some velocity.
+    int32_t entry_step_offset;
 };
 
 struct LinearAxis {
     char name;
     struct Stepper* stepper;
     struct Stepper* stepper2;
+    // Optional input shaper that the axis' queued steps go through, it steps
+    // both of the axis' steppers.
+    struct InputShaper* shaper;
 
     // Motion configuration. These members can be changed directly.
 
     float steps_per_mm;
     // Maximum velocity in mm/s
     float velocity_mm_s;
-    // Constant acceleration in mm/s^2
+    // Maximum acceleration in mm/s^2
     float acceleration_mm_s2;
+    // Maximum jerk in mm/s^3. When zero the axis accelerates at a constant
+    // rate (a trapezoidal velocity profile), otherwise the acceleration is
+    // ramped up and down to limit jerk (an S-curve velocity profile).
+    float jerk_mm_s3;
     // Which direction to home, either -1 for backwards or +1 for forwards.
     int8_t homing_direction;
     // How far to try to move during homing.
@@ -49,6 +116,15 @@ struct LinearAxis {
     // Homing sensitivity, used to set the TMC2209's stallguard threshold.
     // Higher = more sensitive.
     uint8_t homing_sensitivity;
+    // Home in a single pass at the homing velocity, instead of bouncing back
+    // and seeking home again.
+    bool homing_single_pass;
+    // For axes with two motors, watch both motors for stalls during homing
+    // and stop each one as soon as it stalls, squaring up the gantry. The
+    // second motor is then moved by the offset, away from home, to make up
+    // for any difference between the two sides.
+    bool homing_squaring;
+    float homing_squaring_offset_mm;
     // Endstop GPIO, if using endstop
     uint8_t endstop;
 
@@ -57,25 +133,133 @@ struct LinearAxis {
     // Note: it takes two calls to LinearAxis_step() to complete an actual motor
     // step. This is because the first call send the falling edge and the
     // second calls the rising edge.
-    // Time between subsequent calls to LinearAxis_step()
+    // Time between subsequent calls to LinearAxis_step(), in fixed-point
+    // microseconds with LINEAR_AXIS_INTERVAL_FRACTION_BITS fractional bits.
     int64_t _step_interval;
     // Time when the LinearAxis_step() will actually step.
     absolute_time_t _next_step_at;
+    // The fraction of a microsecond that _next_step_at was rounded down by.
+    // This is carried over to the next step so that the rounding errors
+    // don't add up.
+    uint32_t _step_remainder;
+    // How far through the acceleration ramp the axis is, in time.
+    uint32_t _ramp_position;
 
     // internal acceleration and velocity state for the current move.
     struct LinearAxisMovement _current_move;
+
+    // internal homing state, see LinearAxis_homing_step().
+    enum LinearAxisHomingState _homing_state;
+    bool _homing_with_endstop;
+    // Whether the current seek is watching the position latches, they're
+    // only reset once a sensorless seek is up to speed.
+    bool _homing_latch_armed;
+    // The velocity and acceleration to go back to once homing is done.
+    float _homing_old_velocity_mm_s;
+    float _homing_old_acceleration_mm_s2;
+    // Motors that LinearAxis_direct_step() leaves alone, so that the motors
+    // of a dual-motor axis can be moved separately while homing.
+    bool _stepper_halted;
+    bool _stepper2_halted;
+
+    // Acceleration profiles for recently planned moves.
+    struct LinearAxisProfile _profiles[LINEAR_AXIS_PROFILE_CACHE_SIZE];
+    uint32_t _profile_uses;
 };
 
 void LinearAxis_init(struct LinearAxis* m, char name, struct Stepper* stepper);
 
 inline void LinearAxis_setup_dual(struct LinearAxis* m, struct Stepper* stepper) { m->stepper2 = stepper; }
 
+// Homes the axis, waiting until it's done.
 void LinearAxis_sensorless_home(struct LinearAxis* m);
 void LinearAxis_endstop_home(struct LinearAxis* m);
 
-struct LinearAxisMovement LinearAxis_calculate_move(struct LinearAxis* m, float dest_mm);
+// Starts homing the axis without waiting for it. LinearAxis_homing_step()
+// needs to be called until it returns false, several axes can be homed at the
+// same time by stepping each of them in the same loop. Afterwards
+// LinearAxis_finish_homing() puts the drivers back, it's kept out of the loop
+// since it talks to the drivers.
+void LinearAxis_start_sensorless_homing(struct LinearAxis* m);
+void LinearAxis_start_endstop_homing(struct LinearAxis* m);
+bool LinearAxis_homing_step(struct LinearAxis* m);
+void LinearAxis_finish_homing(struct LinearAxis* m);
+
+// Moves the axis back and forth from its current position, raising the
+// acceleration from start_mm_s2 to end_mm_s2 until StallGuard catches the
+// motor stalling. Returns the highest acceleration that didn't stall, or zero
+// if even the first one did. The axis has to be homed again after a stall.
+float LinearAxis_tune_acceleration(
+    struct LinearAxis* m, float distance_mm, float start_mm_s2, float end_mm_s2, float step_mm_s2, uint32_t cycles);
+
+// Calculates the movement needed to bring the axis to the given destination.
+// The movement is written into the given struct so that it can be planned in
+// place, such as directly into a slot in the machine's move queue.
+void LinearAxis_calculate_move(struct LinearAxis* m, struct LinearAxisMovement* move, float dest_mm);
+
+// Like LinearAxis_calculate_move(), but calculates the move from the given
+// position (in steps) instead of the axis' current position. This is used to
+// plan moves that are queued behind other moves.
+void LinearAxis_calculate_move_from(
+    struct LinearAxis* m, struct LinearAxisMovement* move, int32_t start_steps, float dest_mm);
 
-void LinearAxis_start_move(struct LinearAxis* m, struct LinearAxisMovement move);
+// Returns the acceleration profile for the given kinematics, either from the
+// axis' cache or by calculating it and replacing the least recently used
+// entry.
+const struct LinearAxisProfile* LinearAxis_get_profile(
+    struct LinearAxis* m, float velocity_mm_s, float acceleration_mm_s2, float jerk_mm_s3);
+
+// (Re-)calculates the acceleration, coasting, and deceleration phases for a
+// move so that it starts and ends at the given velocities.
+void LinearAxis_calculate_move_profile(
+    struct LinearAxis* m, struct LinearAxisMovement* move, float entry_velocity_mm_s, float exit_velocity_mm_s);
+
+// Switches the move over to a profile with the given velocity, acceleration,
+// and jerk instead of the axis' own. This is used for the major axis of
+// coordinated moves, which only gets its share of the path's limits.
+void LinearAxis_set_move_kinematics(
+    struct LinearAxis* m,
+    struct LinearAxisMovement* move,
+    float velocity_mm_s,
+    float acceleration_mm_s2,
+    float jerk_mm_s3);
+
+// Like LinearAxis_calculate_move_profile(), but takes the entry and exit
+// velocities as offsets into the move's acceleration ramp. This only does
+// integer math, so it's cheap enough for the step alarm to use when it starts
+// a move.
+void LinearAxisMovement_set_profile(
+    struct LinearAxisMovement* move, int32_t entry_step_offset, int32_t exit_step_offset);
+
+// Returns the number of steps needed to accelerate from a standstill to the
+// given velocity using the move's acceleration profile.
+int32_t LinearAxis_calculate_ramp_steps(
+    struct LinearAxis* m, const struct LinearAxisMovement* move, float velocity_mm_s);
+
+// Returns the distance needed to accelerate from a standstill to the given
+// velocity using the move's acceleration profile.
+float LinearAxisMovement_ramp_distance_mm(const struct LinearAxisMovement* move, float velocity_mm_s);
+
+// The inverse of LinearAxisMovement_ramp_distance_mm(): returns the velocity
+// reached after accelerating from a standstill over the given distance. This
+// is capped at the move's maximum velocity.
+float LinearAxisMovement_ramp_velocity_mm_s(const struct LinearAxisMovement* move, float distance_mm);
+
+// Returns how long it takes to move the given distance, starting and ending
+// at a standstill, with the given velocity, acceleration, and jerk.
+float LinearAxis_move_time_s(float distance_mm, float velocity_mm_s, float acceleration_mm_s2, float jerk_mm_s3);
+
+// Returns the velocity, up to the given velocity, that makes a move over the
+// given distance take the given amount of time. This is used to slow moves
+// down so that they finish along with other axes.
+float LinearAxis_velocity_for_move_time(
+    float distance_mm, float move_time_s, float velocity_mm_s, float acceleration_mm_s2, float jerk_mm_s3);
+
+// Starts the move. A move that continues on from the previous one picks up
+// from the axis' last step, otherwise the first step happens a little while
+// after start_at. That's on the step streams' timeline for moves that are
+// queued into the streams, and real time for moves that are stepped directly.
+void LinearAxis_start_move(struct LinearAxis* m, const struct LinearAxisMovement* move, absolute_time_t start_at);
 
 void LinearAxis_wait_for_move(struct LinearAxis* m);
 
@@ -96,6 +280,16 @@ bool LinearAxis_timed_step(struct LinearAxis* m);
 
 void LinearAxis_direct_step(struct LinearAxis* m);
 
+// Like LinearAxis_timed_step(), but instead of stepping when the next step is
+// due it queues the step to the stepper's stream ahead of time. Returns false
+// if the next step is after the given horizon.
+bool LinearAxis_queue_step(struct LinearAxis* m, absolute_time_t horizon);
+
+// Like LinearAxis_direct_step(), but queues the step to the stepper's stream
+// to happen at the given time.
+void LinearAxis_queue_direct_step(struct LinearAxis* m, absolute_time_t at);
+
+// Works out the time between the axis' last step and its next step. This
+// only uses integer math and takes the same amount of time for every step.
 void LinearAxis_lookup_step_interval(struct LinearAxis* m);
 
-uint32_t LinearAxisMovement_calculate_lut_entry(struct LinearAxis* a, uint32_t steps);
@@ -12,29 +12,96 @@
 void RotationalAxis_init(struct RotationalAxis* m, char name, struct Stepper* stepper) {
     m->name = name;
     m->stepper = stepper;
-    m->_delta_steps = 0;
+    m->velocity_deg_s = 1000.0f;
+    m->acceleration_deg_s2 = 10000.0f;
+    m->modulo_rotation = false;
+
+    LinearAxis_init(&(m->_axis), name, stepper);
 }
 
-void RotationalAxis_start_move(struct RotationalAxis* m, float dest_deg) {
-    int32_t dest_steps = (int32_t)(lroundf(ceilf(dest_deg * m->steps_per_deg)));
-    int32_t delta_steps = dest_steps - m->stepper->total_steps;
-    int32_t dir = delta_steps < 0 ? -1 : 1;
-    int32_t abs_delta_steps = abs(delta_steps);
+struct RotationalAxisMovement RotationalAxis_calculate_move(struct RotationalAxis* m, float dest_deg) {
+    return RotationalAxis_calculate_move_from(m, m->stepper->total_steps, dest_deg);
+}
 
-    m->stepper->direction = dir;
-    m->_delta_steps = abs_delta_steps;
-    m->_step_interval = 100;
-    m->_next_step_at = make_timeout_time_us(m->_step_interval);
+struct RotationalAxisMovement
+RotationalAxis_calculate_move_from(struct RotationalAxis* m, int32_t start_steps, float dest_deg) {
+    int32_t dest_steps = (int32_t)(lroundf(ceilf(dest_deg * m->steps_per_deg)));
+    int32_t delta_steps = dest_steps - start_steps;
 
     float actual_delta_deg = delta_steps * (1.0f / m->steps_per_deg);
 
-    Stepper_update_direction(m->stepper);
+    report_info_ln("Calculated %c axis move: %0.2f deg (%li steps)", m->name, (double)actual_delta_deg, delta_steps);
 
-    report_info_ln(
-        "moving %c axis %0.2f deg (%li steps)",
-        m->name,
-        (double)actual_delta_deg,
-        m->stepper->direction * m->_delta_steps);
+    struct RotationalAxisMovement move = {
+        .direction = delta_steps < 0 ? -1 : 1,
+        .total_step_count = abs(delta_steps),
+    };
+    move._movement = (struct LinearAxisMovement){
+        .direction = move.direction,
+        .total_step_count = move.total_step_count,
+    };
+
+    // The step generator's "millimeters" are degrees.
+    m->_axis.steps_per_mm = m->steps_per_deg;
+    LinearAxis_set_move_kinematics(&(m->_axis), &(move._movement), m->velocity_deg_s, m->acceleration_deg_s2, 0.0f);
+
+    return move;
+}
+
+float RotationalAxis_shortest_path_deg(struct RotationalAxis* m, int32_t start_steps, float dest_deg) {
+    if (!m->modulo_rotation) {
+        return dest_deg;
+    }
+    float start_deg = (float)(start_steps) * (1.0f / m->steps_per_deg);
+    // remainderf() gives the difference in the range -180 to 180 degrees.
+    return start_deg + remainderf(dest_deg - start_deg, 360.0f);
+}
+
+int32_t __not_in_flash_func(RotationalAxis_wrap_steps)(struct RotationalAxis* m, int32_t steps) {
+    if (!m->modulo_rotation) {
+        return steps;
+    }
+    int32_t steps_per_turn = (int32_t)(lroundf(360.0f * m->steps_per_deg));
+    steps %= steps_per_turn;
+    return steps < 0 ? steps + steps_per_turn : steps;
+}
+
+float RotationalAxisMovement_move_time_s(const struct RotationalAxisMovement* move) {
+    if (move->total_step_count == 0) {
+        return 0.0f;
+    }
+    const struct LinearAxisProfile* profile = move->_movement.profile;
+    return LinearAxis_move_time_s(
+        (float)(move->total_step_count) / profile->steps_per_mm,
+        profile->velocity_mm_s,
+        profile->acceleration_mm_s2,
+        profile->jerk_mm_s3);
+}
+
+void RotationalAxis_set_move_time(struct RotationalAxis* m, struct RotationalAxisMovement* move, float move_time_s) {
+    if (move->total_step_count == 0 || !(move_time_s > RotationalAxisMovement_move_time_s(move))) {
+        return;
+    }
+    const struct LinearAxisProfile* profile = move->_movement.profile;
+    float distance_deg = (float)(move->total_step_count) / profile->steps_per_mm;
+    float velocity_deg_s = LinearAxis_velocity_for_move_time(
+        distance_deg, move_time_s, profile->velocity_mm_s, profile->acceleration_mm_s2, profile->jerk_mm_s3);
+
+    // Rotations slowed down past the longest ramp interval step at a constant
+    // rate instead of ramping, see LinearAxis_lookup_step_interval().
+    if (velocity_deg_s * profile->steps_per_mm <= 1000000.0f / LINEAR_AXIS_MAX_STEP_INTERVAL_US) {
+        velocity_deg_s = distance_deg / move_time_s;
+    }
+    LinearAxis_set_move_kinematics(
+        &(m->_axis), &(move->_movement), velocity_deg_s, profile->acceleration_mm_s2, profile->jerk_mm_s3);
+}
+
+void __not_in_flash_func(RotationalAxis_start_move)(
+    struct RotationalAxis* m, const struct RotationalAxisMovement* move, absolute_time_t start_at) {
+    // The axis has queued all of its previous steps by now, so this is a
+    // safe point to keep a modulo axis' position within a single turn.
+    m->stepper->total_steps = RotationalAxis_wrap_steps(m, m->stepper->total_steps);
+    LinearAxis_start_move(&(m->_axis), &(move->_movement), start_at);
 }
 
 void RotationalAxis_wait_for_move(struct RotationalAxis* m) {
@@ -48,29 +115,25 @@ void RotationalAxis_wait_for_move(struct RotationalAxis* m) {
 }
 
 float RotationalAxis_get_position_deg(struct RotationalAxis* m) {
-    return ((float)(m->stepper->total_steps)) * (1.0f / m->steps_per_deg);
+    return ((float)(RotationalAxis_wrap_steps(m, m->stepper->total_steps))) * (1.0f / m->steps_per_deg);
 }
 
 void RotationalAxis_set_position_deg(struct RotationalAxis* m, float deg) {
-    m->stepper->total_steps = (int32_t)(lroundf(ceilf(deg * m->steps_per_deg)));
+    m->stepper->total_steps = RotationalAxis_wrap_steps(m, (int32_t)(lroundf(ceilf(deg * m->steps_per_deg))));
 }
 
-void RotationalAxis_step(struct RotationalAxis* m) {
-    if (m->_delta_steps == 0) {
+void __not_in_flash_func(RotationalAxis_step)(struct RotationalAxis* m) {
+    if (!RotationalAxis_is_moving(m)) {
         return;
     }
 
-    if (absolute_time_diff_us(get_absolute_time(), m->_next_step_at) > 0) {
-        return;
-    }
-
-    Stepper_step(m->stepper);
+    LinearAxis_timed_step(&(m->_axis));
+}
 
-    if (m->_delta_steps > 0) {
-        m->_delta_steps--;
-    } else {
-        m->_delta_steps++;
+bool __not_in_flash_func(RotationalAxis_queue_step)(struct RotationalAxis* m, absolute_time_t horizon) {
+    if (!RotationalAxis_is_moving(m)) {
+        return false;
     }
 
-    m->_next_step_at = make_timeout_time_us(m->_step_interval);
+    return LinearAxis_queue_step(&(m->_axis), horizon);
 }
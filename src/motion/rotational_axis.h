@@ -1,29 +1,70 @@
 #pragma once
 
+#include "linear_axis.h"
 #include "pico/time.h"
 #include "stepper.h"
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
+struct RotationalAxisMovement {
+    // Direction of travel, +1 or -1.
+    int8_t direction;
+    // Total number of steps that need to be taken.
+    int32_t total_step_count;
+    // The movement for the axis' step generator, see RotationalAxis._axis.
+    struct LinearAxisMovement _movement;
+};
+
 struct RotationalAxis {
     char name;
 
     struct Stepper* stepper;
 
+    // Motion configuration. These members can be changed directly.
+
     float steps_per_deg;
+    // Maximum velocity in deg/s
+    float velocity_deg_s;
+    // Maximum acceleration in deg/s^2
+    float acceleration_deg_s2;
+    // Whether the axis' position wraps around every 360 degrees. Absolute
+    // moves on a modulo axis take the shorter way around to the destination.
+    bool modulo_rotation;
 
     // internal state
-    int32_t _delta_steps;
-    int64_t _step_interval;
-    absolute_time_t _next_step_at;
+
+    // Rotations accelerate and decelerate just like linear moves do, so the
+    // axis' steps are generated by a LinearAxis that works in degrees instead
+    // of millimeters.
+    struct LinearAxis _axis;
 };
 
 void RotationalAxis_init(struct RotationalAxis* m, char name, struct Stepper* stepper);
-void RotationalAxis_start_move(struct RotationalAxis* m, float dest_deg);
+struct RotationalAxisMovement RotationalAxis_calculate_move(struct RotationalAxis* m, float dest_deg);
+struct RotationalAxisMovement
+RotationalAxis_calculate_move_from(struct RotationalAxis* m, int32_t start_steps, float dest_deg);
+// Returns the destination that's equivalent to dest_deg but closest to the
+// given position (in steps), or dest_deg itself if the axis isn't a modulo
+// axis.
+float RotationalAxis_shortest_path_deg(struct RotationalAxis* m, int32_t start_steps, float dest_deg);
+// Wraps the given position (in steps) into a single turn, if the axis is a
+// modulo axis.
+int32_t RotationalAxis_wrap_steps(struct RotationalAxis* m, int32_t steps);
+// Returns how long the move takes.
+float RotationalAxisMovement_move_time_s(const struct RotationalAxisMovement* move);
+// Slows the move down so that it takes the given amount of time, moves can't
+// be sped up this way.
+void RotationalAxis_set_move_time(struct RotationalAxis* m, struct RotationalAxisMovement* move, float move_time_s);
+// See LinearAxis_start_move().
+void RotationalAxis_start_move(
+    struct RotationalAxis* m, const struct RotationalAxisMovement* move, absolute_time_t start_at);
 void RotationalAxis_wait_for_move(struct RotationalAxis* m);
 void RotationalAxis_step(struct RotationalAxis* m);
-inline bool RotationalAxis_is_moving(struct RotationalAxis* m) { return m->_delta_steps != 0; }
-void RotationalAxis_stop(struct RotationalAxis* m);
+// Like RotationalAxis_step(), but queues the step to the stepper's stream
+// ahead of time. Returns false if the next step is after the given horizon.
+bool RotationalAxis_queue_step(struct RotationalAxis* m, absolute_time_t horizon);
+static inline bool RotationalAxis_is_moving(struct RotationalAxis* m) { return LinearAxis_is_moving(&(m->_axis)); }
+static inline void RotationalAxis_stop(struct RotationalAxis* m) { LinearAxis_stop(&(m->_axis)); }
 float RotationalAxis_get_position_deg(struct RotationalAxis* m);
 void RotationalAxis_set_position_deg(struct RotationalAxis* m, float deg);
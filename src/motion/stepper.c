@@ -1,25 +1,26 @@
 #include "stepper.h"
 #include "drivers/tmc2209_helper.h"
+#include "hardware/dma.h"
 #include "hardware/gpio.h"
+#include "hardware/irq.h"
+#include "hardware/pio.h"
 #include "pico/time.h"
 #include "report.h"
+#include "stepper.pio.h"
 
-// TMC2209 Datasheet section 13.1 notes timing requirements:
-// - T(DSU) - DIR to STEP setup time = 20 ns
-// - T(SH) - STEP minimum high time = 100 ns
-// - T(SL) - STEP minimum low time = 100 ns
-// We add a little bit just to be on the safe side.
-#define TIMING_T_DSU_NS 80
-#define TIMING_T_SH_NS 150
-#define TIMING_T_SL_NS 150
-// Running at 125 MHz, each clock cycle is 8 ns.
-#define TIMING_CYCLE_NS 8
-#define NS_TO_CYCLES(n) ((uint32_t)(n / TIMING_CYCLE_NS))
-
-// Calculate delays based on timing information above
-#define DIR_SETUP_DELAY_CYCLES NS_TO_CYCLES(TIMING_T_DSU_NS)
-#define STEP_HIGH_DELAY_CYCLES NS_TO_CYCLES(TIMING_T_SH_NS)
-#define STEP_LOW_DELAY_CYCLES NS_TO_CYCLES(TIMING_T_SL_NS)
+// Step pulses are generated by the PIO, see stepper.pio for how they're
+// timed. Its clock determines the resolution of the step timing.
+#define STEPPER_PIO pio1
+#define STEPPER_PIO_FREQ_HZ 5000000
+#define STEPPER_PIO_CYCLES_PER_US (STEPPER_PIO_FREQ_HZ / 1000000)
+
+static int program_offset = -1;
+static struct Stepper* dma_streams[NUM_DMA_CHANNELS];
+// The steppers that are waiting for a pin to latch their position, by GPIO.
+static struct Stepper* latching_steppers[NUM_BANK0_GPIOS];
+
+static void dma_irq_handler();
+static void latch_irq_handler(uint gpio, uint32_t events);
 
 /*
     Public functions
@@ -46,6 +47,9 @@ void Stepper_init(
     s->hold_current = hold_current;
 
     s->total_steps = 0;
+    s->missed_deadlines = 0;
+    s->_latched = false;
+    s->_latched_steps = 0;
 }
 
 bool Stepper_setup(struct Stepper* s) {
@@ -53,13 +57,25 @@ bool Stepper_setup(struct Stepper* s) {
     gpio_set_dir(s->pin_enn, GPIO_OUT);
     gpio_put(s->pin_enn, true);
 
-    gpio_init(s->pin_dir);
-    gpio_set_dir(s->pin_dir, GPIO_OUT);
-    gpio_put(s->pin_dir, s->direction > 0 ? !s->reversed : s->reversed);
+    // The step and direction pins are driven by the PIO.
+    if (program_offset < 0) {
+        program_offset = pio_add_program(STEPPER_PIO, &stepper_program);
+    }
 
-    gpio_init(s->pin_step);
-    gpio_set_dir(s->pin_step, GPIO_OUT);
-    gpio_put(s->pin_step, false);
+    s->_pio_sm = pio_claim_unused_sm(STEPPER_PIO, true);
+    stepper_program_init(STEPPER_PIO, s->_pio_sm, program_offset, s->pin_dir, s->pin_step, STEPPER_PIO_FREQ_HZ);
+
+    s->_dma_channel = dma_claim_unused_channel(true);
+    dma_channel_config dma_config = dma_channel_get_default_config(s->_dma_channel);
+    channel_config_set_transfer_data_size(&dma_config, DMA_SIZE_32);
+    channel_config_set_read_increment(&dma_config, true);
+    channel_config_set_write_increment(&dma_config, false);
+    channel_config_set_dreq(&dma_config, pio_get_dreq(STEPPER_PIO, s->_pio_sm, true));
+    dma_channel_configure(s->_dma_channel, &dma_config, &(STEPPER_PIO->txf[s->_pio_sm]), NULL, 0, false);
+    dma_channel_set_irq1_enabled(s->_dma_channel, true);
+    dma_streams[s->_dma_channel] = s;
+    s->_stream_dma_busy = false;
+    s->_stream_fill_count = 0;
 
     gpio_init(s->pin_diag);
     gpio_set_dir(s->pin_diag, GPIO_IN);
@@ -107,37 +123,215 @@ static inline void set_stealthchop(struct Stepper* s, bool enabled) {
 void Stepper_enable_stealthchop(struct Stepper* s) { set_stealthchop(s, true); }
 void Stepper_disable_stealthchop(struct Stepper* s) { set_stealthchop(s, false); }
 
+bool Stepper_read_stallguard_result(struct Stepper* s, uint16_t* result) {
+    uint32_t sg_result;
+    if (TMC2209_read(s->tmc, TMC2209_SG_RESULT, &sg_result) != TMC_READ_OK) {
+        return false;
+    }
+
+    *result = (uint16_t)(TMC_GET_FIELD(sg_result, TMC2209_SG_RESULT));
+    return true;
+}
+
 bool Stepper_stalled(struct Stepper* s) {
-    // Note: this works well because Fishfood doesn't do stepping using an
-    // interrupt, so there's no need to asynchronously handle this. If,
-    // in the future, this assumption changes this needs to use the GPIO
-    // IRQ.
+    // Note: this is only noticed whenever it's polled, homing uses
+    // Stepper_arm_latch() instead to catch the exact step that the stall
+    // happened at.
     return gpio_get(s->pin_diag);
 }
 
-void Stepper_update_direction(struct Stepper* s) {
-    gpio_put(s->pin_dir, s->direction > 0 ? !s->reversed : s->reversed);
-    busy_wait_at_least_cycles(DIR_SETUP_DELAY_CYCLES);
+void Stepper_arm_latch(struct Stepper* s, uint8_t pin) {
+    s->_latch_pin = pin;
+    latching_steppers[pin] = s;
+    gpio_set_irq_enabled_with_callback(pin, GPIO_IRQ_EDGE_RISE, true, latch_irq_handler);
+    Stepper_reset_latch(s);
 }
 
-void Stepper_step(struct Stepper* s) {
-    gpio_put(s->pin_step, true);
-    busy_wait_at_least_cycles(STEP_HIGH_DELAY_CYCLES);
-    gpio_put(s->pin_step, false);
-    busy_wait_at_least_cycles(STEP_LOW_DELAY_CYCLES);
+void __not_in_flash_func(Stepper_reset_latch)(struct Stepper* s) {
+    s->_latched = false;
 
-    s->total_steps += s->direction;
+    // If the pin is already high there won't be an edge.
+    if (gpio_get(s->_latch_pin)) {
+        latch_irq_handler(s->_latch_pin, GPIO_IRQ_EDGE_RISE);
+    }
+}
+
+void Stepper_disarm_latch(struct Stepper* s) {
+    gpio_set_irq_enabled(s->_latch_pin, GPIO_IRQ_EDGE_RISE, false);
+    latching_steppers[s->_latch_pin] = NULL;
+}
+
+static inline uint32_t step_word(struct Stepper* s, bool step, uint32_t delay_cycles) {
+    bool dir = s->direction > 0 ? !s->reversed : s->reversed;
+    return (delay_cycles << 2) | ((uint32_t)(step) << 1) | (uint32_t)(dir);
 }
 
-void Stepper_step_two(struct Stepper* s1, struct Stepper* s2) {
-    gpio_put(s1->pin_step, true);
-    gpio_put(s2->pin_step, true);
+void __not_in_flash_func(Stepper_step)(struct Stepper* s) {
+    pio_sm_put_blocking(STEPPER_PIO, s->_pio_sm, step_word(s, true, 0));
+    s->total_steps += s->direction;
+}
 
-    busy_wait_at_least_cycles(STEP_HIGH_DELAY_CYCLES);
-    gpio_put(s1->pin_step, false);
-    gpio_put(s2->pin_step, false);
-    busy_wait_at_least_cycles(STEP_LOW_DELAY_CYCLES);
+void __not_in_flash_func(Stepper_step_two)(struct Stepper* s1, struct Stepper* s2) {
+    pio_sm_put_blocking(STEPPER_PIO, s1->_pio_sm, step_word(s1, true, 0));
+    pio_sm_put_blocking(STEPPER_PIO, s2->_pio_sm, step_word(s2, true, 0));
 
     s1->total_steps += s1->direction;
     s2->total_steps += s2->direction;
 }
+
+/*
+    Step streams
+*/
+
+static inline int64_t stream_cycles_at(struct Stepper* s, absolute_time_t t) {
+    return absolute_time_diff_us(s->_stream_origin, t) * STEPPER_PIO_CYCLES_PER_US;
+}
+
+// Returns false if there's no room for the word, which is only the case while
+// both blocks are full.
+static bool __not_in_flash_func(queue_word)(struct Stepper* s, uint32_t word) {
+    if (Stepper_stream_full(s)) {
+        return false;
+    }
+
+    s->_stream_blocks[s->_stream_fill_block][s->_stream_fill_count] = word;
+    s->_stream_fill_count++;
+
+    if (Stepper_stream_full(s)) {
+        Stepper_flush_stream(s);
+    }
+    return true;
+}
+
+void Stepper_prepare_stream(struct Stepper* s, absolute_time_t origin) {
+    // Aborting can raise the completion interrupt, so keep it quiet while
+    // the channel is stopped.
+    dma_channel_set_irq1_enabled(s->_dma_channel, false);
+    dma_channel_abort(s->_dma_channel);
+    dma_channel_acknowledge_irq1(s->_dma_channel);
+    dma_channel_set_irq1_enabled(s->_dma_channel, true);
+
+    pio_sm_set_enabled(STEPPER_PIO, s->_pio_sm, false);
+    pio_sm_clear_fifos(STEPPER_PIO, s->_pio_sm);
+    pio_sm_restart(STEPPER_PIO, s->_pio_sm);
+    pio_sm_exec(STEPPER_PIO, s->_pio_sm, pio_encode_jmp(program_offset));
+    STEPPER_PIO->fdebug = 1u << (PIO_FDEBUG_TXSTALL_LSB + s->_pio_sm);
+
+    s->_stream_origin = origin;
+    s->_stream_ticks = 0;
+    s->_stream_fill_block = 0;
+    s->_stream_fill_count = 0;
+    s->_stream_dma_busy = false;
+}
+
+void Stepper_setup_stream_irq() {
+    irq_set_exclusive_handler(DMA_IRQ_1, dma_irq_handler);
+    irq_set_enabled(DMA_IRQ_1, true);
+}
+
+void Stepper_start_streams(struct Stepper* steppers, size_t count) {
+    uint32_t mask = 0;
+    for (size_t i = 0; i < count; i++) {
+        struct Stepper* s = &(steppers[i]);
+        // Give DMA a moment to fill up the FIFO, otherwise the state machine
+        // could get ahead of its first block.
+        while (dma_channel_is_busy(s->_dma_channel) && !pio_sm_is_tx_fifo_full(STEPPER_PIO, s->_pio_sm)) {}
+        mask |= 1u << s->_pio_sm;
+    }
+    pio_enable_sm_mask_in_sync(STEPPER_PIO, mask);
+}
+
+void Stepper_stop_stream(struct Stepper* s) {
+    Stepper_prepare_stream(s, get_absolute_time());
+    pio_sm_set_enabled(STEPPER_PIO, s->_pio_sm, true);
+}
+
+void __not_in_flash_func(Stepper_queue_step)(struct Stepper* s, absolute_time_t at) {
+    int64_t delay_cycles = stream_cycles_at(s, at) - (int64_t)(s->_stream_ticks) - stepper_step_offset_cycles;
+    if (delay_cycles < 0) {
+        // The stream is already past the step's time, so step as soon as
+        // possible. The following steps are still timed from their own
+        // scheduled times, so the stream catches back up.
+        s->missed_deadlines++;
+        delay_cycles = 0;
+    }
+
+    if (!queue_word(s, step_word(s, true, (uint32_t)(delay_cycles)))) {
+        // Callers check Stepper_stream_full() first, so this shouldn't
+        // happen. Dropping the step keeps total_steps true to the motor.
+        s->missed_deadlines++;
+        return;
+    }
+    s->_stream_ticks += (uint64_t)(delay_cycles) + stepper_word_cycles;
+    s->total_steps += s->direction;
+}
+
+void __not_in_flash_func(Stepper_pad_stream)(struct Stepper* s, absolute_time_t until) {
+    if (Stepper_stream_full(s)) {
+        return;
+    }
+
+    // Stop just short of the given time, so that a step at that time can
+    // still happen on time.
+    int64_t wait_cycles = stream_cycles_at(s, until) - (int64_t)(s->_stream_ticks) - stepper_step_offset_cycles;
+    if (wait_cycles < stepper_word_cycles) {
+        return;
+    }
+
+    if (!queue_word(s, step_word(s, false, (uint32_t)(wait_cycles - stepper_word_cycles)))) {
+        return;
+    }
+    s->_stream_ticks += (uint64_t)(wait_cycles);
+}
+
+void __not_in_flash_func(Stepper_flush_stream)(struct Stepper* s) {
+    if (s->_stream_dma_busy || s->_stream_fill_count == 0) {
+        return;
+    }
+
+    // Clear the stall flag, it's used to tell when the stream has drained.
+    STEPPER_PIO->fdebug = 1u << (PIO_FDEBUG_TXSTALL_LSB + s->_pio_sm);
+
+    s->_stream_dma_busy = true;
+    dma_channel_set_trans_count(s->_dma_channel, s->_stream_fill_count, false);
+    dma_channel_set_read_addr(s->_dma_channel, s->_stream_blocks[s->_stream_fill_block], true);
+
+    s->_stream_fill_block ^= 1;
+    s->_stream_fill_count = 0;
+}
+
+absolute_time_t Stepper_stream_end(struct Stepper* s) {
+    return delayed_by_us(
+        s->_stream_origin, (s->_stream_ticks + STEPPER_PIO_CYCLES_PER_US - 1) / STEPPER_PIO_CYCLES_PER_US);
+}
+
+bool Stepper_stream_drained(struct Stepper* s) {
+    return !s->_stream_dma_busy && s->_stream_fill_count == 0 &&
+           pio_sm_is_tx_fifo_empty(STEPPER_PIO, s->_pio_sm) &&
+           (STEPPER_PIO->fdebug & (1u << (PIO_FDEBUG_TXSTALL_LSB + s->_pio_sm)));
+}
+
+static void __not_in_flash_func(dma_irq_handler)() {
+    for (size_t channel = 0; channel < NUM_DMA_CHANNELS; channel++) {
+        struct Stepper* s = dma_streams[channel];
+        if (s == NULL || !dma_channel_get_irq1_status(channel)) {
+            continue;
+        }
+
+        dma_channel_acknowledge_irq1(channel);
+        s->_stream_dma_busy = false;
+
+        // Keep the PIO fed with the next block, if there is one.
+        Stepper_flush_stream(s);
+    }
+}
+
+static void __not_in_flash_func(latch_irq_handler)(uint gpio, uint32_t events __unused) {
+    // Note: steps are taken on the same core that armed the latch, so
+    // total_steps can't change while this runs.
+    struct Stepper* s = latching_steppers[gpio];
+    if (s != NULL && !s->_latched) {
+        s->_latched_steps = s->total_steps;
+        s->_latched = true;
+    }
+}
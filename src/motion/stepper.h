@@ -1,9 +1,14 @@
 #pragma once
 
 #include "drivers/tmc2209.h"
+#include "pico/time.h"
 #include <stddef.h>
 #include <stdint.h>
 
+// How many steps fit in each of the two blocks used to stream steps to the
+// PIO. One block is sent to the PIO using DMA while the other is filled.
+#define STEPPER_STREAM_BLOCK_SIZE 256
+
 struct Stepper {
     // Configuration
     struct TMC2209* tmc;
@@ -18,7 +23,32 @@ struct Stepper {
     // State
     // 1 for forwards -1 for backwards.
     int8_t direction;
+    // Note: while streaming, this includes steps that have been queued but
+    // haven't actually happened yet.
     int32_t total_steps;
+    // How many steps happened later than they were scheduled to. Late steps
+    // don't push back the steps after them, so the stepper catches back up
+    // with its schedule- this is only for diagnostics.
+    uint32_t missed_deadlines;
+
+    // Position latching, see Stepper_arm_latch().
+    uint8_t _latch_pin;
+    volatile bool _latched;
+    volatile int32_t _latched_steps;
+
+    // Step generation
+    uint8_t _pio_sm;
+    uint8_t _dma_channel;
+    // The stream's timeline starts at _stream_origin, _stream_ticks is how
+    // far along the timeline (in PIO cycles) the queued steps reach. This is
+    // 64-bit since 32 bits of PIO cycles only last about 14 minutes.
+    absolute_time_t _stream_origin;
+    uint64_t _stream_ticks;
+    uint32_t _stream_blocks[2][STEPPER_STREAM_BLOCK_SIZE];
+    // The block that's being filled and how much of it is filled.
+    uint8_t _stream_fill_block;
+    size_t _stream_fill_count;
+    volatile bool _stream_dma_busy;
 };
 
 void Stepper_init(
@@ -40,6 +70,68 @@ void Stepper_disable_stealthchop(struct Stepper* s);
 void Stepper_enable_stallguard(struct Stepper* s, uint8_t threshold);
 void Stepper_disable_stallguard(struct Stepper* s);
 bool Stepper_stalled(struct Stepper* s);
-void Stepper_update_direction(struct Stepper* s);
+// Reads the driver's StallGuard result, a higher value means less load on the
+// motor. It's only meaningful in StealthChop while the motor is moving. Returns
+// false if the driver couldn't be read.
+bool Stepper_read_stallguard_result(struct Stepper* s, uint16_t* result);
+// Records total_steps, using the GPIO interrupt, as soon as the given pin
+// (such as the DIAG pin or an endstop) goes high. This catches the exact step
+// that a stall or endstop happened at, even if it isn't polled for a while.
+// The latch has to be armed from the core that steps the stepper.
+void Stepper_arm_latch(struct Stepper* s, uint8_t pin);
+void Stepper_disarm_latch(struct Stepper* s);
+// Forgets whatever an armed latch caught so far, so that it only catches the
+// pin going high from now on. This doesn't touch the driver, so it's quick
+// enough to call in the middle of a move.
+void Stepper_reset_latch(struct Stepper* s);
+static inline bool Stepper_latched(struct Stepper* s) { return s->_latched; }
+static inline int32_t Stepper_latched_steps(struct Stepper* s) { return s->_latched_steps; }
+
+// Steps right away. These are used for homing, the step pulse itself is
+// generated by the PIO.
 void Stepper_step(struct Stepper* s);
 void Stepper_step_two(struct Stepper* s1, struct Stepper* s2);
+
+/*
+    Step streams
+
+    Instead of stepping right away, steps can be queued up ahead of time along
+    with the time they need to happen. The steps are sent to the PIO in blocks
+    using DMA and the PIO takes care of their timing, so the CPU only needs to
+    keep the blocks topped up. Steppers that are streamed together need to be
+    started at the same time with Stepper_start_streams() so that their
+    timelines line up.
+*/
+
+// Installs the interrupt that keeps the streams fed. Interrupts are handled by
+// the core that enables them, so this needs to be called from the core that
+// generates the steps.
+void Stepper_setup_stream_irq();
+// Resets the stream and stops its PIO state machine until the stream is
+// started. The timeline of the stream begins at the given time.
+void Stepper_prepare_stream(struct Stepper* s, absolute_time_t origin);
+// Starts the given streams in sync, at least one block should be queued up
+// for each one.
+void Stepper_start_streams(struct Stepper* steppers, size_t count);
+// Stops the stream right away, throwing away any steps that haven't happened
+// yet.
+void Stepper_stop_stream(struct Stepper* s);
+// Queues a step to happen at the given time. Steps that are closer together
+// than the PIO allows just happen as soon as possible.
+void Stepper_queue_step(struct Stepper* s, absolute_time_t at);
+// Fills the stream with a wait up until the given time, this keeps the PIO
+// busy when the stepper isn't moving so that it stays in sync with the
+// other streams.
+void Stepper_pad_stream(struct Stepper* s, absolute_time_t until);
+// Hands the current block to DMA if the previous one is finished.
+void Stepper_flush_stream(struct Stepper* s);
+// Returns the time that the last queued step (or wait) finishes.
+absolute_time_t Stepper_stream_end(struct Stepper* s);
+// Returns true once everything queued has been sent through the PIO.
+bool Stepper_stream_drained(struct Stepper* s);
+
+// Returns true if no more steps can be queued until DMA finishes with the
+// block that it's sending.
+static inline bool Stepper_stream_full(struct Stepper* s) {
+    return s->_stream_fill_count >= STEPPER_STREAM_BLOCK_SIZE;
+}
@@ -33,6 +33,8 @@ pub fn build(b: *Builder) void {
     main.addIncludePath("../src/motion");
     main.addCSourceFile("../src/report.c", &cflags);
     main.addCSourceFile("../src/motion/linear_axis.c", &cflags);
+    main.addCSourceFile("../src/motion/rotational_axis.c", &cflags);
+    main.addCSourceFile("../src/motion/input_shaper.c", &cflags);
 
     main.install();
 
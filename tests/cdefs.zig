@@ -1,4 +1,7 @@
 pub usingnamespace @cImport({
     @cInclude("stepper.h");
     @cInclude("linear_axis.h");
+    @cInclude("rotational_axis.h");
+    @cInclude("dda.h");
+    @cInclude("input_shaper.h");
 });
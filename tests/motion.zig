@@ -16,35 +16,87 @@ fn make_stepper() c.Stepper {
         .hold_current = 0,
         .direction = 1,
         .total_steps = 0,
+        .missed_deadlines = 0,
+        ._latch_pin = 0,
+        ._latched = false,
+        ._latched_steps = 0,
+        ._pio_sm = 0,
+        ._dma_channel = 0,
+        ._stream_origin = 0,
+        ._stream_ticks = 0,
+        ._stream_blocks = [_][c.STEPPER_STREAM_BLOCK_SIZE]u32{[_]u32{0} ** c.STEPPER_STREAM_BLOCK_SIZE} ** 2,
+        ._stream_fill_block = 0,
+        ._stream_fill_count = 0,
+        ._stream_dma_busy = false,
     };
 }
 
+const interval_one: f64 = @floatFromInt(c.LINEAR_AXIS_INTERVAL_ONE);
+
+fn interval_us(axis: *c.LinearAxis) f64 {
+    return @as(f64, @floatFromInt(axis._step_interval)) / interval_one;
+}
+
+fn to_interval(us: f64) i64 {
+    return @intFromFloat(us * interval_one);
+}
+
+// Queues every step of the axis' current move, calling check() with the
+// number of steps taken so far before each step.
+fn run_move(
+    axis: *c.LinearAxis,
+    context: anytype,
+    comptime check: fn (@TypeOf(context), *c.LinearAxis, i32) anyerror!void,
+) !void {
+    while (c.LinearAxis_is_moving(axis)) {
+        try check(context, axis, axis._current_move.steps_taken);
+        try testing.expectEqual(c.LinearAxis_queue_step(axis, std.math.maxInt(u63)), true);
+    }
+}
+
 fn make_axis(stepper: *c.Stepper) c.LinearAxis {
     return c.LinearAxis{
         .name = 'X',
         .stepper = stepper,
         .stepper2 = null,
+        .shaper = null,
         .steps_per_mm = 160.0,
         .velocity_mm_s = 100,
         .acceleration_mm_s2 = 1000,
+        .jerk_mm_s3 = 0,
         .homing_direction = -1,
         .homing_distance_mm = 1000,
         .homing_bounce_mm = 10,
         .homing_velocity_mm_s = 100,
         .homing_acceleration_mm_s2 = 1000,
         .homing_sensitivity = 127,
+        .homing_single_pass = false,
+        .homing_squaring = false,
+        .homing_squaring_offset_mm = 0,
         .endstop = 0,
         ._step_interval = 0,
         ._next_step_at = 0,
+        ._step_remainder = 0,
+        ._ramp_position = 0,
         ._current_move = .{
             .direction = 1,
+            .profile = null,
             .accel_step_count = 0,
             .decel_step_count = 0,
             .coast_step_count = 0,
             .total_step_count = 0,
             .steps_taken = 0,
-            .lut = [_]u16{0} ** c.LINEAR_AXIS_LUT_COUNT,
+            .entry_step_offset = 0,
         },
+        ._homing_state = c.LINEAR_AXIS_HOMING_DONE,
+        ._homing_with_endstop = false,
+        ._homing_latch_armed = false,
+        ._homing_old_velocity_mm_s = 0,
+        ._homing_old_acceleration_mm_s2 = 0,
+        ._stepper_halted = false,
+        ._stepper2_halted = false,
+        ._profiles = std.mem.zeroes([c.LINEAR_AXIS_PROFILE_CACHE_SIZE]c.LinearAxisProfile),
+        ._profile_uses = 0,
     };
 }
 
@@ -52,7 +104,8 @@ test "LinearAxis: calculate move" {
     var stepper = make_stepper();
     var axis = make_axis(&stepper);
 
-    var move = c.LinearAxis_calculate_move(&axis, 100.0);
+    var move: c.LinearAxisMovement = undefined;
+    c.LinearAxis_calculate_move(&axis, &move, 100.0);
 
     // Millimeters to steps
     // (160 steps/millimeter) × (100 millimeters) = 16000 steps
@@ -75,7 +128,7 @@ test "LinearAxis: calculate move" {
     try testing.expectEqual(move.coast_step_count, 14400);
 
     // Now test a move that doesn't have enough time to get to full speed.
-    move = c.LinearAxis_calculate_move(&axis, 5.0);
+    c.LinearAxis_calculate_move(&axis, &move, 5.0);
 
     // (160 steps/millimeter) × (5 millimeters) = 800 steps
     try testing.expectEqual(move.total_step_count, 800);
@@ -86,59 +139,472 @@ test "LinearAxis: calculate move" {
     try testing.expectEqual(move.coast_step_count, 0);
 }
 
+test "LinearAxis: calculate move with entry and exit velocities" {
+    var stepper = make_stepper();
+    var axis = make_axis(&stepper);
+
+    var move: c.LinearAxisMovement = undefined;
+    c.LinearAxis_calculate_move(&axis, &move, 100.0);
+
+    // Entering at 50 mm/s means the axis starts partway up the acceleration
+    // ramp.
+    // ((50 millimeters/second)^2) / (2 × (1000 millimeters/(second²))) = 1.25 mm
+    // (160 steps/millimeter) × (1.25 millimeters) = 200 steps
+    c.LinearAxis_calculate_move_profile(&axis, &move, 50.0, 0.0);
+
+    try testing.expectEqual(move.total_step_count, 16000);
+    try testing.expectEqual(move.profile.*.ramp_step_count, 800);
+    try testing.expectEqual(move.entry_step_offset, 200);
+    try testing.expectEqual(move.accel_step_count, 600);
+    try testing.expectEqual(move.decel_step_count, 800);
+    try testing.expectEqual(move.coast_step_count, 14600);
+
+    // The first step should happen at the entry velocity.
+    // (1 / ((125 microseconds) / step)) × (1 / (160 steps/millimeter)) = 50 mm/s
+    c.LinearAxis_start_move(&axis, &move, 0);
+    try testing.expectApproxEqAbs(interval_us(&axis), 125.0, 0.5);
+
+    // Exiting at the same velocity shortens the deceleration phase the same
+    // way.
+    c.LinearAxis_calculate_move_profile(&axis, &move, 50.0, 50.0);
+
+    try testing.expectEqual(move.accel_step_count, 600);
+    try testing.expectEqual(move.decel_step_count, 600);
+    try testing.expectEqual(move.coast_step_count, 14800);
+
+    // Now test a move that doesn't have enough time to get to full speed. The
+    // peak is shifted so that the move can still stop in time.
+    c.LinearAxis_calculate_move(&axis, &move, 5.0);
+    c.LinearAxis_calculate_move_profile(&axis, &move, 50.0, 0.0);
+
+    try testing.expectEqual(move.accel_step_count, 300);
+    try testing.expectEqual(move.decel_step_count, 500);
+    try testing.expectEqual(move.coast_step_count, 0);
+
+    // The ramp always covers the full velocity.
+    try testing.expectEqual(move.profile.*.ramp_step_count, 800);
+}
+
+test "LinearAxis: moves share acceleration profiles" {
+    var stepper = make_stepper();
+    var axis = make_axis(&stepper);
+
+    // Moves with the same kinematics use the same profile.
+    var first: c.LinearAxisMovement = undefined;
+    var second: c.LinearAxisMovement = undefined;
+    c.LinearAxis_calculate_move(&axis, &first, 100.0);
+    c.LinearAxis_calculate_move(&axis, &second, 5.0);
+    try testing.expectEqual(first.profile, second.profile);
+
+    // Changing the axis' kinematics calculates a new profile without changing
+    // the profile of moves that were already planned.
+    // ((50 millimeters/second)^2) / (2 × (1000 millimeters/(second²))) = 1.25 mm
+    // (160 steps/millimeter) × (1.25 millimeters) = 200 steps
+    axis.velocity_mm_s = 50;
+    c.LinearAxis_calculate_move(&axis, &second, 100.0);
+    try testing.expect(first.profile != second.profile);
+    try testing.expectEqual(first.profile.*.ramp_step_count, 800);
+    try testing.expectEqual(second.profile.*.ramp_step_count, 200);
+}
+
+test "LinearAxis: profiles with extreme accelerations" {
+    var stepper = make_stepper();
+    var axis = make_axis(&stepper);
+    var move: c.LinearAxisMovement = undefined;
+
+    // A very low acceleration has a long first step.
+    // √(2 × ((1 / 80) millimeters) / (10 millimeters/(second²))) = 50 ms
+    // 2^38 / ((100 millimeters/second) / (10 millimeters/(second²))) ≈ 27488 per microsecond
+    axis.steps_per_mm = 80;
+    axis.acceleration_mm_s2 = 10;
+    c.LinearAxis_calculate_move(&axis, &move, 100.0);
+    try testing.expectApproxEqRel(
+        @as(f64, @floatFromInt(move.profile.*.first_step_interval)),
+        @as(f64, @floatFromInt(to_interval(50000.0))),
+        0.001,
+    );
+    try testing.expectApproxEqAbs(@as(f64, @floatFromInt(move.profile.*.ramp_rate)), 27488.0, 1.0);
+
+    // A very short ramp is stretched out to the shortest ramp that fits.
+    // (100 millimeters/second) / (10^7 millimeters/(second²)) = 10 microseconds
+    axis.steps_per_mm = 160;
+    axis.acceleration_mm_s2 = 10000000;
+    c.LinearAxis_calculate_move(&axis, &move, 10.0);
+    try testing.expectEqual(move.profile.*.ramp_rate, 1 << 31);
+    c.LinearAxis_start_move(&axis, &move, 0);
+    while (c.LinearAxis_is_moving(&axis)) {
+        try testing.expectEqual(c.LinearAxis_queue_step(&axis, std.math.maxInt(u63)), true);
+        try testing.expect(axis._step_interval > 0);
+    }
+    try testing.expectEqual(stepper.total_steps, 1600);
+}
+
+test "LinearAxis: set move kinematics" {
+    var stepper = make_stepper();
+    var axis = make_axis(&stepper);
+
+    // The major axis of a coordinated move only gets its share of the path's
+    // limits, here half of them.
+    // ((50 millimeters/second)^2) / (2 × (500 millimeters/(second²))) = 2.5 mm
+    // (160 steps/millimeter) × (2.5 millimeters) = 400 steps
+    var move: c.LinearAxisMovement = undefined;
+    c.LinearAxis_calculate_move(&axis, &move, 100.0);
+    c.LinearAxis_set_move_kinematics(&axis, &move, 50.0, 500.0, 0.0);
+
+    try testing.expectEqual(move.profile.*.ramp_step_count, 400);
+    try testing.expectEqual(move.accel_step_count, 400);
+    try testing.expectEqual(move.decel_step_count, 400);
+    try testing.expectEqual(move.coast_step_count, 15200);
+
+    // The axis' own limits are unchanged.
+    try testing.expectEqual(axis.velocity_mm_s, 100.0);
+}
+
+test "LinearAxis: move time" {
+    // 100 ms accelerating, 900 ms coasting, and 100 ms decelerating.
+    try testing.expectApproxEqAbs(c.LinearAxis_move_time_s(100.0, 100.0, 1000.0, 0.0), 1.1, 0.0001);
+
+    // Short moves turn around halfway.
+    // 2 × √(2 × (2.5 millimeters) / (1000 millimeters/(second²))) ≈ 141.4 ms
+    try testing.expectApproxEqAbs(c.LinearAxis_move_time_s(5.0, 100.0, 1000.0, 0.0), 0.1414, 0.0001);
+
+    // Slowing the same move down to take 2 seconds:
+    // (100 millimeters) / v + v / (1000 millimeters/(second²)) = 2 seconds
+    // v ≈ 51.32 mm/s
+    try testing.expectApproxEqAbs(c.LinearAxis_velocity_for_move_time(100.0, 2.0, 100.0, 1000.0, 0.0), 51.32, 0.01);
+
+    // Moves can't be sped up.
+    try testing.expectEqual(c.LinearAxis_velocity_for_move_time(100.0, 0.5, 100.0, 1000.0, 0.0), 100.0);
+}
+
+test "LinearAxis: calculate S-curve move" {
+    var stepper = make_stepper();
+    var axis = make_axis(&stepper);
+
+    // With a jerk limit that's high enough to not matter, the S-curve takes
+    // 1.5× as long as the trapezoid to reach full velocity so that its peak
+    // acceleration stays the same.
+    // 1.5 × (100 millimeters/second) / (1000 millimeters/(second²)) = 150 ms
+    // (1 / 2) × (100 millimeters/second) × (150 milliseconds) = 7.5 mm
+    // (160 steps/millimeter) × (7.5 millimeters) = 1200 steps
+    axis.jerk_mm_s3 = 1000000000;
+    var move: c.LinearAxisMovement = undefined;
+    c.LinearAxis_calculate_move(&axis, &move, 100.0);
+
+    try testing.expectEqual(move.profile.*.ramp_step_count, 1200);
+    try testing.expectEqual(move.accel_step_count, 1200);
+    try testing.expectEqual(move.decel_step_count, 1200);
+    try testing.expectEqual(move.coast_step_count, 13600);
+
+    // Half the velocity is reached halfway through the ramp's duration.
+    // (100 millimeters/second) × (150 milliseconds) × ((1/2)³ - (1/2)⁴ / 2) = 1.40625 mm
+    // (160 steps/millimeter) × (1.40625 millimeters) = 225 steps
+    c.LinearAxis_calculate_move_profile(&axis, &move, 50.0, 0.0);
+    try testing.expectEqual(move.entry_step_offset, 225);
+
+    const distance = c.LinearAxisMovement_ramp_distance_mm(&move, 50.0);
+    try testing.expectApproxEqAbs(c.LinearAxisMovement_ramp_velocity_mm_s(&move, distance), 50.0, 0.01);
+    try testing.expectEqual(c.LinearAxisMovement_ramp_velocity_mm_s(&move, 100.0), 100.0);
+
+    // A lower jerk limit stretches the ramp.
+    // √(6 × (100 millimeters/second) / (20000 millimeters/(second³))) ≈ 173.2 ms
+    // (1 / 2) × (100 millimeters/second) × (173.2 milliseconds) ≈ 8.66 mm
+    // (160 steps/millimeter) × (8.66 millimeters) ≈ 1386 steps
+    axis.jerk_mm_s3 = 20000;
+    c.LinearAxis_calculate_move(&axis, &move, 100.0);
+    try testing.expectEqual(move.profile.*.ramp_step_count, 1386);
+
+    // The velocity follows the S-curve: halfway through the ramp's duration
+    // the axis is at half velocity, and full velocity is reached right at the
+    // end of the ramp.
+    // (100 millimeters/second) × (173.2 milliseconds) × ((1/2)³ - (1/2)⁴ / 2) ≈ 1.624 mm
+    // (160 steps/millimeter) × (1.624 millimeters) ≈ 260 steps
+    // (1 / (50 millimeters/second)) × (1 / (160 steps/millimeter)) = 125 microseconds/step
+    const Check = struct {
+        fn check(_: void, a: *c.LinearAxis, steps: i32) anyerror!void {
+            if (steps == 260) {
+                try testing.expectApproxEqAbs(interval_us(a), 125.0, 1.0);
+            }
+            if (steps == 1387) {
+                try testing.expectEqual(a._step_interval, to_interval(62.5));
+            }
+        }
+    };
+    c.LinearAxis_start_move(&axis, &move, 0);
+    try run_move(&axis, {}, Check.check);
+}
+
 test "LinearAxis: step interval" {
     var stepper = make_stepper();
     var axis = make_axis(&stepper);
 
-    var move = c.LinearAxis_calculate_move(&axis, 100.0);
+    const Check = struct {
+        fn check(_: void, a: *c.LinearAxis, steps: i32) anyerror!void {
+            switch (steps) {
+                // The first step of the ramp takes as long as it takes to
+                // cover one step from a standstill.
+                // √(2 × ((1 / 160) millimeters) / (1000 millimeters/(second²))) ≈ 3535.5 microseconds
+                1 => try testing.expectApproxEqAbs(interval_us(a), 3535.5, 0.5),
+                // Acceleration case: halfway through the acceleration steps,
+                // so the axis should be around 3/4 the final velocity.
+                // √(2 × (1000 millimeters/(second²)) × (2.5 millimeters)) ≈ 70.71 mm/s
+                // (1 / (70.71 millimeters/second)) × (1 / (160 steps/millimeter)) ≈ 88.39 microseconds/step
+                // Deceleration case: halfway through the deceleration steps,
+                // so the velocity should be the same.
+                400, 800 + 14400 + 400 => try testing.expectApproxEqAbs(interval_us(a), 88.39, 0.1),
+                // Coast case: the axis should be moving at its final
+                // velocity, and this interval is exact.
+                // (1 / ((62.5 microseconds) / step)) × (1 / (160 steps/millimeter)) = 100 mm/s
+                8000 => try testing.expectEqual(a._step_interval, to_interval(62.5)),
+                else => {},
+            }
+        }
+    };
 
-    // Simple case first: middle of the coast phase, so the axis should be
-    // moving at its final velocity.
-    axis._current_move = move;
-    axis._current_move.steps_taken = 8000;
+    var move: c.LinearAxisMovement = undefined;
+    c.LinearAxis_calculate_move(&axis, &move, 100.0);
+    c.LinearAxis_start_move(&axis, &move, 0);
+    try run_move(&axis, {}, Check.check);
 
-    c.LinearAxis_lookup_step_interval(&axis);
+    // The whole move should take as long as planned: 100 ms accelerating,
+    // 900 ms coasting, and 100 ms decelerating. The last step is the one
+    // that brings the axis to a stop, so it isn't followed by an interval.
+    try testing.expectApproxEqAbs(@as(f64, @floatFromInt(axis._next_step_at)), 1100000.0 - 3535.5, 500.0);
+}
 
-    // working backwards:
-    // (1 / ((62 microseconds) / step)) × (1 / (160 steps/millimeter)) ≈ 100.8064516 mm/s
-    try testing.expectEqual(axis._step_interval, 62);
+test "LinearAxis: queue steps up to the horizon" {
+    var stepper = make_stepper();
+    var axis = make_axis(&stepper);
 
-    // Acceleration case: halfway through the acceleration steps, so the
-    // axis should be around 3/4 the final velocity.
-    axis._current_move.steps_taken = 400;
+    var move: c.LinearAxisMovement = undefined;
+    c.LinearAxis_calculate_move(&axis, &move, 100.0);
+    c.LinearAxis_start_move(&axis, &move, 0);
 
-    c.LinearAxis_lookup_step_interval(&axis);
+    // The first step happens 100 microseconds after the move starts, nothing
+    // should be queued before then.
+    try testing.expectEqual(c.LinearAxis_queue_step(&axis, 99), false);
+    try testing.expectEqual(stepper.total_steps, 0);
 
-    // working backwards
-    // (1 / ((88 microseconds) / step)) × (1 / (160 steps/millimeter)) ≈ 71.02272727 mm/s
-    try testing.expectEqual(axis._step_interval, 88);
-    try testing.expectEqual(axis._step_interval, axis._current_move.lut[c.LINEAR_AXIS_LUT_COUNT >> 1]);
+    try testing.expectEqual(c.LinearAxis_queue_step(&axis, 100), true);
+    try testing.expectEqual(stepper.total_steps, 1);
 
-    // Deceleration case: halfway through the deceleration steps, so the velocity
-    // should be the same as above.
-    axis._current_move.steps_taken = 800 + 14400 + 400;
-    c.LinearAxis_lookup_step_interval(&axis);
-    try testing.expectEqual(axis._step_interval, 88);
+    // The next step is scheduled relative to the previous step's time, so
+    // the timing stays the same no matter when the steps are queued.
+    try testing.expectEqual(axis._next_step_at, 100 + 3535);
+    try testing.expectEqual(c.LinearAxis_queue_step(&axis, 100 + 3534), false);
+    try testing.expectEqual(c.LinearAxis_queue_step(&axis, 100 + 3535), true);
+    try testing.expectEqual(stepper.total_steps, 2);
+}
+
+test "LinearAxis: moves from a standstill start at the given time" {
+    var stepper = make_stepper();
+    var axis = make_axis(&stepper);
 
-    // Finally, last step case - the velocity should be as low as it'll get
-    axis._current_move.steps_taken = 800 + 14400 + 799;
+    // The start time is on whatever timeline the axis is being stepped on,
+    // so it's used as-is rather than compared against the current time.
+    var move: c.LinearAxisMovement = undefined;
+    c.LinearAxis_calculate_move(&axis, &move, 100.0);
+    c.LinearAxis_start_move(&axis, &move, 5000);
+
+    try testing.expectEqual(axis._next_step_at, 5100);
+    try testing.expectEqual(c.LinearAxis_queue_step(&axis, 5099), false);
+    try testing.expectEqual(c.LinearAxis_queue_step(&axis, 5100), true);
+}
+
+test "LinearAxis: fractional step intervals add up" {
+    var stepper = make_stepper();
+    var axis = make_axis(&stepper);
+
+    // While coasting at 100 mm/s the steps are 62.5 microseconds apart. Each
+    // step time is a whole microsecond, but the leftover half is carried
+    // over so that 100 steps take exactly 6250 microseconds.
+    c.LinearAxis_calculate_move(&axis, &axis._current_move, 100.0);
+    axis._current_move.steps_taken = 8000;
     c.LinearAxis_lookup_step_interval(&axis);
 
-    try testing.expectEqual(axis._step_interval, 1767);
-    try testing.expectEqual(axis._step_interval, axis._current_move.lut[1]);
+    var i: usize = 0;
+    while (i < 100) : (i += 1) {
+        try testing.expectEqual(c.LinearAxis_queue_step(&axis, 1000000), true);
+    }
+    try testing.expectEqual(axis._next_step_at, 6250);
 }
 
-test "LinearAxis: move look up table" {
+test "LinearAxis: step intervals shrink while accelerating" {
     var stepper = make_stepper();
     var axis = make_axis(&stepper);
-    var move = c.LinearAxis_calculate_move(&axis, 100.0);
-
-    // Each entry in the lut table should be less than or equal to the entry
-    // before, since the lut table stores values corresponding to increasing
-    // velocity.
-    var last = move.lut[0];
-    for (move.lut) |current| {
-        try testing.expect(current <= last);
-        last = current;
+
+    // Each step should be quicker than the one before while accelerating,
+    // and slower while decelerating, with both profiles.
+    const Check = struct {
+        fn check(last: *i64, a: *c.LinearAxis, steps: i32) anyerror!void {
+            if (steps > 1 and steps <= a._current_move.accel_step_count) {
+                try testing.expect(a._step_interval <= last.*);
+            }
+            if (steps > a._current_move.accel_step_count + a._current_move.coast_step_count + 1) {
+                try testing.expect(a._step_interval >= last.*);
+            }
+            last.* = a._step_interval;
+        }
+    };
+
+    var last: i64 = 0;
+    var move: c.LinearAxisMovement = undefined;
+    c.LinearAxis_calculate_move(&axis, &move, 100.0);
+    c.LinearAxis_start_move(&axis, &move, 0);
+    try run_move(&axis, &last, Check.check);
+
+    axis.jerk_mm_s3 = 20000;
+    c.LinearAxis_calculate_move(&axis, &move, 0.0);
+    c.LinearAxis_start_move(&axis, &move, axis._next_step_at);
+    try run_move(&axis, &last, Check.check);
+}
+
+test "RotationalAxis: slowed rotations finish along with linear moves" {
+    // Records when the last step of a move is queued.
+    const Check = struct {
+        fn check(last_step_at: *u64, a: *c.LinearAxis, _: i32) anyerror!void {
+            last_step_at.* = a._next_step_at;
+        }
+    };
+
+    var x_stepper = make_stepper();
+    var x = make_axis(&x_stepper);
+    var x_move: c.LinearAxisMovement = undefined;
+    c.LinearAxis_calculate_move(&x, &x_move, 100.0);
+    c.LinearAxis_start_move(&x, &x_move, 0);
+    var x_end: u64 = 0;
+    try run_move(&x, &x_end, Check.check);
+
+    // A 5 degree rotation alongside the 1.1 second linear move steps every
+    // 22 ms, much slower than the start of an acceleration ramp.
+    // (1.1 seconds) / ((5 degrees) × (10 steps/degree)) = 22 milliseconds/step
+    var a_stepper = make_stepper();
+    var a = std.mem.zeroes(c.RotationalAxis);
+    c.RotationalAxis_init(&a, 'A', &a_stepper);
+    a.steps_per_deg = 10.0;
+    var a_move = c.RotationalAxis_calculate_move(&a, 5.0);
+    c.RotationalAxis_set_move_time(&a, &a_move, c.LinearAxis_move_time_s(100.0, 100.0, 1000.0, 0.0));
+    c.RotationalAxis_start_move(&a, &a_move, 0);
+    var a_end: u64 = 0;
+    try run_move(&a._axis, &a_end, Check.check);
+
+    try testing.expectEqual(a_stepper.total_steps, 50);
+    try testing.expectApproxEqAbs(interval_us(&a._axis), 22000.0, 0.01);
+
+    // Both axes take their last step within a step of the rotation.
+    try testing.expectApproxEqAbs(
+        @as(f64, @floatFromInt(a_end)),
+        @as(f64, @floatFromInt(x_end)),
+        22000.0,
+    );
+}
+
+test "DDA: minor axes follow the major axis along a straight line" {
+    var dda: c.DDA = undefined;
+    c.DDA_init(&dda, 1000);
+    _ = c.DDA_add_minor(&dda, 1000);
+    _ = c.DDA_add_minor(&dda, 333);
+    _ = c.DDA_add_minor(&dda, 0);
+
+    var counts = [_]i32{ 0, 0, 0 };
+    var step: i32 = 1;
+    while (step <= 1000) : (step += 1) {
+        const stepped = c.DDA_step(&dda);
+        for (&counts, 0..) |*count, i| {
+            if (stepped & (@as(u32, 1) << @as(u5, @intCast(i))) != 0) {
+                count.* += 1;
+            }
+        }
+
+        // Each minor axis stays within half a step of the line.
+        // |count - (333 / 1000) × step| ≤ 1/2
+        const deviation = counts[1] * 1000 - step * 333;
+        try testing.expect(deviation >= -500 and deviation <= 500);
+    }
+
+    // By the end each minor axis has taken exactly its steps.
+    try testing.expectEqual(counts, [_]i32{ 1000, 333, 0 });
+}
+
+test "InputShaper: shaped steps add up to the unshaped steps" {
+    var stepper = make_stepper();
+    var shaper: c.InputShaper = undefined;
+    c.InputShaper_init(&shaper, &stepper, null);
+
+    // Without damping, a ZV shaper at 50 Hz splits each step into two halves
+    // that are 10 ms apart.
+    try testing.expect(c.InputShaper_configure(&shaper, c.INPUT_SHAPER_ZV, 50.0, 0.0, 100000.0));
+    try testing.expectEqual(shaper._impulse_delay_us[1], 10000);
+    try testing.expectEqual(shaper._impulse_weight[0], c.INPUT_SHAPER_WEIGHT_ONE / 2);
+    try testing.expectEqual(shaper._impulse_weight[1], c.INPUT_SHAPER_WEIGHT_ONE / 2);
+
+    // Only the first halves of the steps have happened by the last step.
+    var i: u64 = 0;
+    while (i < 100) : (i += 1) {
+        c.InputShaper_queue_step(&shaper, 1, 1000 + 100 * i);
     }
+    try testing.expectEqual(stepper.total_steps, 50);
+    try testing.expect(c.InputShaper_is_pending(&shaper));
+    try testing.expectEqual(c.InputShaper_next_step_at(&shaper), 11000);
+
+    // The second halves play out 10 ms later.
+    c.InputShaper_drain(&shaper, 20000);
+    try testing.expectEqual(stepper.total_steps, 95);
+    c.InputShaper_drain(&shaper, 30000);
+    try testing.expectEqual(stepper.total_steps, 100);
+    try testing.expect(!c.InputShaper_is_pending(&shaper));
+
+    // Backwards steps are shaped too, and invalid settings are rejected.
+    i = 0;
+    while (i < 10) : (i += 1) {
+        c.InputShaper_queue_step(&shaper, -1, 30000 + 100 * i);
+    }
+    c.InputShaper_drain(&shaper, 100000);
+    try testing.expectEqual(stepper.total_steps, 90);
+    try testing.expect(!c.InputShaper_configure(&shaper, c.INPUT_SHAPER_MZV, 40.0, 1.0, 100000.0));
+
+    // Shapers that the history is too small for at the axis' step rate are
+    // rejected too. The history holds 2046 steps besides the one being added,
+    // which is 10 ms worth at 204600 steps/s.
+    try testing.expectApproxEqRel(c.InputShaper_max_step_rate_hz(&shaper), 204600.0, 0.0001);
+    try testing.expect(!c.InputShaper_configure(&shaper, c.INPUT_SHAPER_ZV, 50.0, 0.0, 250000.0));
+    try testing.expectEqual(shaper._impulse_delay_us[1], 10000);
+}
+
+test "InputShaper: steps that don't fit in the history still add up" {
+    var stepper = make_stepper();
+    var shaper: c.InputShaper = undefined;
+    c.InputShaper_init(&shaper, &stepper, null);
+    try testing.expect(c.InputShaper_configure(&shaper, c.INPUT_SHAPER_ZV, 50.0, 0.0, 0.0));
+
+    // Stepping every microsecond fills the 10 ms shaper's history, the steps
+    // after that aren't shaped but aren't lost either.
+    var i: u64 = 0;
+    while (i < c.INPUT_SHAPER_HISTORY_SIZE + 100) : (i += 1) {
+        c.InputShaper_queue_step(&shaper, 1, 1000 + i);
+    }
+    try testing.expectEqual(stepper.missed_deadlines, 100);
+    c.InputShaper_drain(&shaper, 100000);
+    try testing.expectEqual(stepper.total_steps, c.INPUT_SHAPER_HISTORY_SIZE + 100);
+    try testing.expect(!c.InputShaper_is_pending(&shaper));
+}
+
+test "InputShaper: shaped steps wait for room in the stream" {
+    var stepper = make_stepper();
+    var shaper: c.InputShaper = undefined;
+    c.InputShaper_init(&shaper, &stepper, null);
+    try testing.expect(c.InputShaper_configure(&shaper, c.INPUT_SHAPER_ZV, 50.0, 0.0, 0.0));
+
+    // While DMA is still busy with the other block, nothing more is queued.
+    stepper._stream_fill_count = c.STEPPER_STREAM_BLOCK_SIZE;
+    c.InputShaper_queue_step(&shaper, 1, 1000);
+    c.InputShaper_drain(&shaper, 20000);
+    try testing.expectEqual(stepper.total_steps, 0);
+    try testing.expect(c.InputShaper_is_pending(&shaper));
+
+    // The step goes out once there's room.
+    stepper._stream_fill_count = 0;
+    c.InputShaper_drain(&shaper, 20000);
+    try testing.expectEqual(stepper.total_steps, 1);
+    try testing.expect(!c.InputShaper_is_pending(&shaper));
 }
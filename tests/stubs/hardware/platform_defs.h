@@ -1,5 +1,6 @@
 #pragma once
 
+#define __not_in_flash(group)
 #define __not_in_flash_func(func) func
 
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
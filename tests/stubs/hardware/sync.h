@@ -0,0 +1,3 @@
+#pragma once
+
+#include "hardware/platform_defs.h"
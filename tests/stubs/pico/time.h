@@ -1,9 +1,14 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 
 typedef uint64_t absolute_time_t;
 
+static const absolute_time_t at_the_end_of_time = INT64_MAX;
+
+static inline bool is_at_the_end_of_time(absolute_time_t t) { return t == at_the_end_of_time; }
+
 static inline uint64_t time_us_64() { return 0; }
 
 static inline uint64_t to_us_since_boot(absolute_time_t t) { return t; }
@@ -24,6 +24,26 @@ export fn Stepper_step_two(s1: [*c]c.Stepper, s2: [*c]c.Stepper) void {
     _ = s2;
 }
 
-export fn Stepper_update_direction(s: [*c]c.Stepper) void {
+export fn Stepper_queue_step(s: [*c]c.Stepper, at: c.absolute_time_t) void {
+    _ = at;
+    s.*.total_steps += s.*.direction;
+}
+
+export fn Stepper_read_stallguard_result(s: [*c]c.Stepper, result: [*c]u16) bool {
+    _ = s;
+    _ = result;
+    return false;
+}
+
+export fn Stepper_arm_latch(s: [*c]c.Stepper, pin: u8) void {
+    _ = pin;
+    s.*._latched = false;
+}
+
+export fn Stepper_reset_latch(s: [*c]c.Stepper) void {
+    s.*._latched = false;
+}
+
+export fn Stepper_disarm_latch(s: [*c]c.Stepper) void {
     _ = s;
 }